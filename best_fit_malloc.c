@@ -6,6 +6,8 @@
 #include <stdlib.h>
 #include <string.h>
 
+#include "malloc_hooks.h"
+
 // Interfaces to get memory pages from OS
 void *mmap_from_system(size_t size);
 void munmap_to_system(void *ptr, size_t size);
@@ -97,6 +99,87 @@ void best_fit_remove_from_tree(best_fit_metadata_t *metadata) {
   best_fit_tree.free_head = best_fit_remove_recursive(metadata, best_fit_tree.free_head);
 }
 
+// Append the free slots of |tree| except the dummy to |list|, which is linked
+// through |left|, and return the new list.
+best_fit_metadata_t *best_fit_collect_free_slots(best_fit_metadata_t *tree,
+                                                 best_fit_metadata_t *list) {
+  if (!tree) {
+    return list;
+  }
+  best_fit_metadata_t *right = tree->right;
+  list = best_fit_collect_free_slots(tree->left, list);
+  list = best_fit_collect_free_slots(right, list);
+  if (tree != &best_fit_tree.dummy) {
+    tree->left = list;
+    list = tree;
+  }
+  return list;
+}
+
+// Sort a list linked through |left| by address (merge sort).
+best_fit_metadata_t *best_fit_sort_by_address(best_fit_metadata_t *list) {
+  if (!list || !list->left) {
+    return list;
+  }
+  best_fit_metadata_t *slow = list;
+  best_fit_metadata_t *fast = list->left;
+  while (fast && fast->left) {
+    slow = slow->left;
+    fast = fast->left->left;
+  }
+  best_fit_metadata_t *second = slow->left;
+  slow->left = NULL;
+  best_fit_metadata_t *a = best_fit_sort_by_address(list);
+  best_fit_metadata_t *b = best_fit_sort_by_address(second);
+  best_fit_metadata_t head;
+  best_fit_metadata_t *tail = &head;
+  while (a && b) {
+    if (a < b) {
+      tail->left = a;
+      a = a->left;
+    } else {
+      tail->left = b;
+      b = b->left;
+    }
+    tail = tail->left;
+  }
+  tail->left = a ? a : b;
+  return head.left;
+}
+
+// Merge the free slots that are next to each other in memory, and return the
+// slots that cover whole regions to the system. This is called when the
+// memory budget is exhausted, so that a malloc can still succeed from a
+// merged slot or from the memory given back.
+void best_fit_coalesce() {
+  best_fit_metadata_t *list = best_fit_collect_free_slots(best_fit_tree.free_head, NULL);
+  list = best_fit_sort_by_address(list);
+  best_fit_tree.free_head = &best_fit_tree.dummy;
+  best_fit_tree.dummy.left = NULL;
+  best_fit_tree.dummy.right = NULL;
+  best_fit_tree.dummy.height = 1;
+  while (list) {
+    best_fit_metadata_t *metadata = list;
+    list = list->left;
+    // Merge the following slots that start right where this one ends.
+    while (list && (char *)(metadata + 1) + metadata->size == (char *)list) {
+      metadata->size += sizeof(best_fit_metadata_t) + list->size;
+      list = list->left;
+    }
+    size_t span = sizeof(best_fit_metadata_t) + metadata->size;
+    if ((uintptr_t)metadata % 4096 == 0 && span % 4096 == 0) {
+      // The slot covers whole regions, which nothing else points into.
+      MALLOC_HOOK(on_unmap, metadata, span);
+      munmap_to_system(metadata, span);
+      continue;
+    }
+    metadata->left = NULL;
+    metadata->right = NULL;
+    metadata->height = 1;
+    best_fit_insert_to_tree(metadata);
+  }
+}
+
 // This is called at the beginning of each challenge.
 void best_fit_initialize() {
   best_fit_tree.free_head = &best_fit_tree.dummy;
@@ -135,6 +218,21 @@ void *best_fit_malloc(size_t size) {
     //            buffer_size
     size_t buffer_size = 4096;
     metadata = (best_fit_metadata_t *)mmap_from_system(buffer_size);
+    if (!metadata) {
+      // The memory budget is exhausted. Coalesce the free slots and retry
+      // once, from a merged slot or with the regions that were unmapped.
+      best_fit_coalesce();
+      for (metadata = best_fit_tree.free_head; metadata; metadata = metadata->right) {
+        if (metadata->size >= size) {
+          return best_fit_malloc(size);
+        }
+      }
+      metadata = (best_fit_metadata_t *)mmap_from_system(buffer_size);
+      if (!metadata) {
+        return NULL;
+      }
+    }
+    MALLOC_HOOK(on_map, metadata, buffer_size);
     metadata->size = buffer_size - sizeof(best_fit_metadata_t);
     metadata->left = NULL;
     metadata->right = NULL;
@@ -180,6 +278,7 @@ void *best_fit_malloc(size_t size) {
     // Add the remaining free slot to the free list.
     best_fit_insert_to_tree(new_metadata);
   }
+  MALLOC_HOOK(on_malloc, ptr, size);
   return ptr;
 }
 
@@ -192,6 +291,7 @@ void best_fit_free(void *ptr) {
   //     ^          ^
   //     metadata   ptr
   best_fit_metadata_t *metadata = (best_fit_metadata_t *)ptr - 1;
+  MALLOC_HOOK(on_free, ptr, metadata->size);
   // Add the free slot to the free list.
   best_fit_insert_to_tree(metadata);
 }
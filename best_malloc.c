@@ -6,6 +6,9 @@
 #include <stdlib.h>
 #include <string.h>
 
+#include "best_malloc_stats.h"
+#include "malloc_hooks.h"
+
 // Interfaces to get memory pages from OS
 void *mmap_from_system(size_t size);
 void munmap_to_system(void *ptr, size_t size);
@@ -13,21 +16,281 @@ void munmap_to_system(void *ptr, size_t size);
 // Functions in common
 int max(int a, int b);
 
+// A configuration generated by tune_malloc.bin from malloc traces (see
+// `make best_malloc_config.h`). Anything it does not define keeps the default
+// below.
+#ifdef USE_BEST_MALLOC_CONFIG
+#include "best_malloc_config.h"
+#endif
+// After the configuration, which may override the defaults it defines.
+#include "best_malloc.h"
+
+// Size classes are learned from the running workload. One in
+// BEST_SAMPLE_INTERVAL requested sizes is recorded in a histogram, and every
+// BEST_RETUNE_INTERVAL samples the hottest sizes (those that make up at least
+// 1 / BEST_HOT_SHARE of the samples) are promoted to exact-size slabs. Sizes
+// that cool down are demoted and their free slots go back to the tree. The
+// histogram is halved on every retune so that it follows phase changes.
+#define BEST_SLAB_CLASSES 4
+#define BEST_SAMPLE_INTERVAL 16
+#define BEST_RETUNE_INTERVAL 256
+#define BEST_HOT_SHARE 8
+#define BEST_HISTOGRAM_SIZE (4000 / 8 + 1)
+_Static_assert(BEST_STATS_CLASSES >= BEST_SLAB_CLASSES,
+               "The statistics page needs an entry for every slab class");
+
+// Tunable parameters. These are the defaults of best_config_t.
+//   *  BEST_REGION_SIZE: The size of a region requested from the system.
+//   *  BEST_SPLIT_THRESHOLD: A free slot is split only if more than this many
+//      bytes remain. It must be at least the size of the metadata. The
+//      default is in best_malloc.h.
+//   *  BEST_SLAB_CHUNK_SIZE: The bytes carved into slots per slab refill.
+//   *  BEST_SLAB_MAX_FREE: The max number of free slots a slab keeps (its
+//      quick-list depth). Further frees go to the tree.
+//   *  BEST_STATIC_CLASS_SIZES: Sizes that are slabs from the beginning and
+//      never demoted.
+#ifndef BEST_REGION_SIZE
+#define BEST_REGION_SIZE 4096
+#endif
+#ifndef BEST_SLAB_CHUNK_SIZE
+#define BEST_SLAB_CHUNK_SIZE 4096
+#endif
+#ifndef BEST_SLAB_MAX_FREE
+#define BEST_SLAB_MAX_FREE ((size_t)-1)
+#endif
+#ifndef BEST_STATIC_CLASS_COUNT
+#define BEST_STATIC_CLASS_COUNT 0
+#define BEST_STATIC_CLASS_SIZES {0}
+#endif
+
+// Allocation-site lifetime prediction (with ENABLE_BEST_SITE_PREDICTION).
+// Objects are keyed by the return address of best_malloc(). When an object
+// is freed, its lifetime in mallocs is compared with BEST_LONG_LIFETIME and
+// counted as short or long for its site. Objects of sites that turn out to be
+// long-lived, including sites whose objects are mostly never freed, are placed
+// in a separate tree with its own regions so that they do not pin pages full
+// of short-lived objects.
+#define BEST_SITES 64
+#define BEST_SITE_MIN_SAMPLES 64
+#define BEST_SITE_WINDOW 4096
+#define BEST_LONG_LIFETIME (1 << 14)
+
+// |kind| of the regions and free slots of the long-lived tree.
+#define BEST_KIND_LONG_LIVED (-1)
+
+// Sampling heap profiler (with ENABLE_BEST_HEAP_PROFILE). As in tcmalloc,
+// every malloc decrements a byte counter that starts at a geometrically
+// distributed value with mean BEST_PROFILE_RATE, and the malloc that crosses
+// zero is sampled. A sample records the address, the size, the allocation
+// clock and up to BEST_PROFILE_DEPTH return addresses found by walking frame
+// pointers, so build with -fno-omit-frame-pointer. Samples go to a ring of
+// BEST_PROFILE_SAMPLES entries. A new sample takes the next entry whose object
+// has been freed; live samples are never overwritten, so when all entries are
+// live the new sample is dropped and counted instead.
+#ifndef BEST_PROFILE_RATE
+#define BEST_PROFILE_RATE (512 * 1024)
+#endif
+#define BEST_PROFILE_SAMPLES 1024
+#define BEST_PROFILE_DEPTH 6
+// A saved frame pointer further than this from the current frame is taken to
+// be garbage, which ends the backtrace.
+#define BEST_PROFILE_MAX_FRAME_SIZE (64 * 1024)
+
+// The state dump (best_request_dump()) lists up to this many mapped spans.
+// Adjacent regions are merged, so this is rarely reached.
+#define BEST_MAX_REGIONS 256
+// The free slot sizes are histogrammed by powers of two up to 2^BEST_DUMP_BUCKETS.
+#define BEST_DUMP_BUCKETS 24
+
+// Real-time reserve (best_set_reserve()). Regions the tree needs are taken
+// from a list of mapped and prefaulted regions instead of mmap_from_system(),
+// so that a malloc never waits for a system call or a page fault. The list is
+// refilled outside malloc by best_refill_reserve(), e.g. at the end of each
+// epoch: when it drops below half of its target (the low watermark), it is
+// refilled to the target (the high watermark) with one mapping. The target is
+// twice the regions needed between two refills, and at least
+// BEST_RESERVE_MIN_REGIONS. Every reserve region is as large as the largest
+// buffer the tree maps, a slab chunk if chunks are larger than regions, so
+// that oversized requests are served from the reserve too. best_finalize()
+// unmaps what is left of it.
+#define BEST_RESERVE_MIN_REGIONS 16
+
+// Static tracepoints (with ENABLE_BEST_USDT). Each probe is a nop plus a note
+// in the binary until a tracer attaches to it, e.g.
+//   bpftrace -e 'usdt:./malloc_challenge_with_usdt.bin:best_malloc:region_map
+//                { @bytes = sum(arg1); }' -c ./malloc_challenge_with_usdt.bin
+// The probes of provider best_malloc are:
+//   *  malloc_entry(size), malloc_exit(ptr, size)
+//   *  region_map(ptr, size): a new region was mapped for the tree.
+//   *  reclaim(mapped_size): the memory budget was hit, so the slabs are
+//      flushed and the trees coalesced.
+//   *  coalesce(tree, free_count), region_unmap(ptr, size): a tree is
+//      coalesced and a span of whole pages it freed is returned (purged).
+//   *  rebalance(node, balance): a tree node is rotated.
+// Without ENABLE_BEST_USDT, which the Makefile only defines if sys/sdt.h is
+// found, the probes compile to nothing.
+#ifdef ENABLE_BEST_USDT
+#include <sys/sdt.h>
+#define BEST_PROBE(name, ...) STAP_PROBEV(best_malloc, name, ##__VA_ARGS__)
+#else
+#define BEST_PROBE(name, ...) \
+  do {                        \
+  } while (0)
+#endif
+
 // Struct definitions
+//
+// For a free slot in the tree, |left|, |right| and |height| are the AVL tree
+// links. For an allocated object, |birth| and |site| record when and where it
+// was allocated if site prediction is enabled, and |height| is the sample of
+// the object (1-origin) or 0 if the heap profiler is enabled. |kind| is the
+// slab class the object was carved from (1-origin), 0 if it came from the
+// tree and BEST_KIND_LONG_LIVED if it came from the long-lived tree. |kind|
+// fits in the padding after |height|, so the metadata stays 32 bytes.
 typedef struct best_metadata_t {
   size_t size;
-  struct best_metadata_t *left;
-  struct best_metadata_t *right;
+  union {
+    struct {
+      struct best_metadata_t *left;
+      struct best_metadata_t *right;
+    };
+    struct {
+      size_t birth;
+      size_t site;
+    };
+  };
   int height;
+  int kind;
 } best_metadata_t;
+_Static_assert(sizeof(best_metadata_t) == BEST_METADATA_SIZE,
+               "BEST_METADATA_SIZE must match best_metadata_t");
 
+// A best-fit tree with its own regions. |dummy| is a dummy free slot.
 typedef struct best_tree_t {
   best_metadata_t *free_head;
   best_metadata_t dummy;
 } best_tree_t;
 
+// An exact-size slab. |size| is 0 if the class is unused. Free slots are
+// linked through |left|. A |pinned| slab is never demoted. |live_count| is
+// the number of slots handed out and not yet freed since the promotion.
+typedef struct best_slab_t {
+  size_t size;
+  best_metadata_t *free_head;
+  size_t free_count;
+  size_t live_count;
+  bool pinned;
+} best_slab_t;
+
+typedef struct best_config_t {
+  size_t region_size;
+  size_t split_threshold;
+  size_t slab_chunk_size;
+  size_t slab_max_free;
+  int static_class_count;
+  size_t static_class_sizes[BEST_SLAB_CLASSES];
+} best_config_t;
+
+// The lifetime statistics of an allocation site.
+typedef struct best_site_t {
+  void *address;
+  size_t first_seen;
+  size_t alloc_count;
+  size_t free_count;
+  size_t short_count;
+  size_t long_count;
+} best_site_t;
+
+// A sampled allocation. |ptr| is NULL once the object is freed, and |size| is
+// 0 if the entry has never been used.
+typedef struct best_sample_t {
+  void *ptr;
+  size_t size;
+  size_t timestamp;
+  int depth;
+  void *stack[BEST_PROFILE_DEPTH];
+} best_sample_t;
+
+typedef struct best_profile_t {
+  long long bytes_until_sample;
+  uint64_t random_state;
+  // The number of samples taken so far, and of those dropped because every
+  // entry held a live sample.
+  size_t sample_count;
+  size_t dropped_count;
+  // The entry after the one the last sample went to, where the search for a
+  // free entry starts.
+  int next_index;
+  best_sample_t samples[BEST_PROFILE_SAMPLES];
+} best_profile_t;
+
+// A span of memory mapped from the system, merged with the spans next to it.
+typedef struct best_region_t {
+  uintptr_t start;
+  size_t size;
+} best_region_t;
+
+// Counters for the statistics page. They are plain increments on the hot
+// path; the page is only written outside malloc and free.
+typedef struct best_counters_t {
+  size_t mapped_size;
+  size_t live_size;
+  // The free slots in the trees. Free slab slots are counted from the slabs.
+  size_t tree_free_size;
+  size_t tree_free_count;
+  size_t malloc_count;
+  size_t free_count;
+} best_counters_t;
+
+typedef struct best_heap_t {
+  // |trees[0]| holds the regular objects and the slabs, |trees[1]| the
+  // objects of long-lived sites.
+  best_tree_t trees[2];
+  best_config_t config;
+  best_slab_t slabs[BEST_SLAB_CLASSES];
+  // |slab_index[size / 8]| is the class serving |size|, or 0 if none.
+  unsigned char slab_index[BEST_HISTOGRAM_SIZE];
+  unsigned sample_countdown;
+  unsigned samples;
+  unsigned histogram[BEST_HISTOGRAM_SIZE];
+  // The number of mallocs that were not served by popping a slab slot.
+  size_t slow_path_count;
+  // The number of mallocs so far, used as the clock for object lifetimes and
+  // sample timestamps.
+  size_t clock;
+  // |sites[i - 1]| is site i. Site 0 means the table was full.
+  best_site_t sites[BEST_SITES];
+  best_counters_t counters;
+  // The page to publish the counters to, or NULL.
+  best_stats_page_t *stats_page;
+  // The mapped spans sorted by address, for the state dump. Spans that did
+  // not fit are only counted.
+  best_region_t regions[BEST_MAX_REGIONS];
+  int region_count;
+  size_t untracked_region_count;
+  // Set while a malloc, a free or an initialization is changing the heap. A
+  // dump requested by a signal in the meantime is left |dump_pending| with
+  // its |dump_write_func| and written when the allocator returns.
+  volatile bool in_allocator;
+  volatile bool dump_pending;
+  void (*dump_write_func)(const char *data, size_t size);
+  // The real-time reserve. Its regions of |reserve_region_size| bytes are
+  // linked through |left|.
+  bool reserve_enabled;
+  best_metadata_t *reserve_head;
+  size_t reserve_region_size;
+  size_t reserve_count;
+  size_t reserve_target;
+  // The regions the tree needed since the last refill, whether the reserve
+  // had them or not.
+  size_t reserve_demand_count;
+#ifdef ENABLE_BEST_HEAP_PROFILE
+  best_profile_t profile;
+#endif
+} best_heap_t;
+
 // Static variables (DO NOT ADD ANOTHER STATIC VARIABLES!)
-best_tree_t best_tree;
+best_heap_t best_heap;
 
 // Helper functions
 best_metadata_t *best_balance_tree(best_metadata_t *tree) {
@@ -36,12 +299,14 @@ best_metadata_t *best_balance_tree(best_metadata_t *tree) {
   tree->height = 1 + max(left_height, right_height);
 
   if (left_height + 1 < right_height) {
+    BEST_PROBE(rebalance, tree, right_height - left_height);
     best_metadata_t *right = tree->right;
     best_metadata_t *right_left = right->left;
     right->left = tree;
     tree->right = right_left;
     return right;
   } else if (right_height + 1 < left_height) {
+    BEST_PROBE(rebalance, tree, right_height - left_height);
     best_metadata_t *left = tree->left;
     best_metadata_t *left_right = left->right;
     left->right = tree;
@@ -89,31 +354,534 @@ best_metadata_t *best_remove_recursive(best_metadata_t *metadata,
   return best_balance_tree(tree);
 }
 
+// Return the tree that owns the free slots of |kind|.
+best_tree_t *best_tree_of(int kind) {
+  return &best_heap.trees[kind == BEST_KIND_LONG_LIVED];
+}
+
 void best_insert_to_tree(best_metadata_t *metadata) {
-  best_tree.free_head = best_insert_recursive(metadata, best_tree.free_head);
+  best_tree_t *tree = best_tree_of(metadata->kind);
+  tree->free_head = best_insert_recursive(metadata, tree->free_head);
+  best_heap.counters.tree_free_size += metadata->size;
+  best_heap.counters.tree_free_count++;
 }
 
 void best_remove_from_tree(best_metadata_t *metadata) {
-  best_tree.free_head = best_remove_recursive(metadata, best_tree.free_head);
+  best_tree_t *tree = best_tree_of(metadata->kind);
+  tree->free_head = best_remove_recursive(metadata, tree->free_head);
+  best_heap.counters.tree_free_size -= metadata->size;
+  best_heap.counters.tree_free_count--;
+}
+
+// Record that [ptr, ptr + size) was mapped.
+void best_add_region(void *ptr, size_t size) {
+  uintptr_t start = (uintptr_t)ptr;
+  best_region_t *regions = best_heap.regions;
+  int i = 0;
+  while (i < best_heap.region_count && regions[i].start < start) {
+    i++;
+  }
+  bool after_previous = i > 0 && regions[i - 1].start + regions[i - 1].size == start;
+  bool before_next = i < best_heap.region_count && start + size == regions[i].start;
+  if (after_previous && before_next) {
+    regions[i - 1].size += size + regions[i].size;
+    for (int j = i + 1; j < best_heap.region_count; j++) {
+      regions[j - 1] = regions[j];
+    }
+    best_heap.region_count--;
+  } else if (after_previous) {
+    regions[i - 1].size += size;
+  } else if (before_next) {
+    regions[i].start = start;
+    regions[i].size += size;
+  } else if (best_heap.region_count == BEST_MAX_REGIONS) {
+    best_heap.untracked_region_count++;
+  } else {
+    for (int j = best_heap.region_count; j > i; j--) {
+      regions[j] = regions[j - 1];
+    }
+    regions[i].start = start;
+    regions[i].size = size;
+    best_heap.region_count++;
+  }
+}
+
+// Record that [ptr, ptr + size) was unmapped. It may cut a span in two.
+void best_remove_region(void *ptr, size_t size) {
+  uintptr_t start = (uintptr_t)ptr;
+  best_region_t *regions = best_heap.regions;
+  for (int i = 0; i < best_heap.region_count; i++) {
+    uintptr_t end = regions[i].start + regions[i].size;
+    if (start < regions[i].start || start >= end) {
+      continue;
+    }
+    if (start == regions[i].start && start + size == end) {
+      for (int j = i + 1; j < best_heap.region_count; j++) {
+        regions[j - 1] = regions[j];
+      }
+      best_heap.region_count--;
+    } else if (start == regions[i].start) {
+      regions[i].start += size;
+      regions[i].size -= size;
+    } else {
+      regions[i].size = start - regions[i].start;
+      if (start + size < end) {
+        // The part after the hole becomes a span of its own.
+        best_add_region((void *)(start + size), end - start - size);
+      }
+    }
+    return;
+  }
+}
+
+// Move all the free slots of a slab back to the tree. The class stays in use
+// and refills from the tree on its next malloc.
+void best_flush_slab(int class) {
+  best_slab_t *slab = &best_heap.slabs[class - 1];
+  best_metadata_t *metadata = slab->free_head;
+  while (metadata) {
+    best_metadata_t *next = metadata->left;
+    metadata->left = NULL;
+    metadata->right = NULL;
+    metadata->height = 1;
+    metadata->kind = 0;
+    best_insert_to_tree(metadata);
+    metadata = next;
+  }
+  slab->free_head = NULL;
+  slab->free_count = 0;
+}
+
+// Move all the free slots of a slab back to the tree and retire the class.
+void best_demote_slab(int class) {
+  best_slab_t *slab = &best_heap.slabs[class - 1];
+  best_heap.slab_index[slab->size / 8] = 0;
+  best_flush_slab(class);
+  slab->size = 0;
+}
+
+// Emergency reclamation for when the system refuses to map more memory (a
+// memory budget). Free slots are never merged on the usual paths, so after a
+// while the trees hold many small slots that no longer fit anything. Here
+// the slab caches are flushed to the tree, then each tree is rebuilt: its
+// free slots are sorted by address, neighbours are merged, and merged slots
+// that cover whole pages are unmapped.
+
+// Append the free slots of |tree| except the dummy to |list|, which is linked
+// through |left|, and return the new list.
+best_metadata_t *best_collect_free_slots(best_metadata_t *tree, best_metadata_t *dummy,
+                                         best_metadata_t *list) {
+  if (!tree) {
+    return list;
+  }
+  best_metadata_t *right = tree->right;
+  list = best_collect_free_slots(tree->left, dummy, list);
+  list = best_collect_free_slots(right, dummy, list);
+  if (tree != dummy) {
+    tree->left = list;
+    list = tree;
+  }
+  return list;
+}
+
+// Sort a list linked through |left| by address (merge sort).
+best_metadata_t *best_sort_by_address(best_metadata_t *list) {
+  if (!list || !list->left) {
+    return list;
+  }
+  best_metadata_t *slow = list;
+  best_metadata_t *fast = list->left;
+  while (fast && fast->left) {
+    slow = slow->left;
+    fast = fast->left->left;
+  }
+  best_metadata_t *second = slow->left;
+  slow->left = NULL;
+  best_metadata_t *a = best_sort_by_address(list);
+  best_metadata_t *b = best_sort_by_address(second);
+  best_metadata_t head;
+  best_metadata_t *tail = &head;
+  while (a && b) {
+    if (a < b) {
+      tail->left = a;
+      a = a->left;
+    } else {
+      tail->left = b;
+      b = b->left;
+    }
+    tail = tail->left;
+  }
+  tail->left = a ? a : b;
+  return head.left;
+}
+
+void best_coalesce_tree(best_tree_t *tree) {
+  BEST_PROBE(coalesce, tree, best_heap.counters.tree_free_count);
+  best_metadata_t *list = best_collect_free_slots(tree->free_head, &tree->dummy, NULL);
+  list = best_sort_by_address(list);
+  tree->free_head = &tree->dummy;
+  tree->dummy.left = NULL;
+  tree->dummy.right = NULL;
+  tree->dummy.height = 1;
+  for (best_metadata_t *metadata = list; metadata; metadata = metadata->left) {
+    best_heap.counters.tree_free_size -= metadata->size;
+    best_heap.counters.tree_free_count--;
+  }
+
+  while (list) {
+    best_metadata_t *metadata = list;
+    list = list->left;
+    // Merge the following slots that start right where this one ends.
+    while (list && (char *)(metadata + 1) + metadata->size == (char *)list) {
+      metadata->size += sizeof(best_metadata_t) + list->size;
+      list = list->left;
+    }
+    size_t span = sizeof(best_metadata_t) + metadata->size;
+    if ((uintptr_t)metadata % 4096 == 0 && span % 4096 == 0) {
+      // The slot covers whole regions, which nothing else points into.
+      MALLOC_HOOK(on_unmap, metadata, span);
+      BEST_PROBE(region_unmap, metadata, span);
+      munmap_to_system(metadata, span);
+      best_remove_region(metadata, span);
+      best_heap.counters.mapped_size -= span;
+      continue;
+    }
+    metadata->left = NULL;
+    metadata->right = NULL;
+    metadata->height = 1;
+    best_insert_to_tree(metadata);
+  }
+}
+
+void best_reclaim() {
+  BEST_PROBE(reclaim, best_heap.counters.mapped_size);
+  for (int class = 1; class <= BEST_SLAB_CLASSES; class++) {
+    if (best_heap.slabs[class - 1].size) {
+      best_flush_slab(class);
+    }
+  }
+  for (int i = 0; i < 2; i++) {
+    best_coalesce_tree(&best_heap.trees[i]);
+  }
+}
+
+// Promote |size| to an unused slab class. Does nothing if all classes are in
+// use.
+void best_promote_slab(size_t size) {
+  for (int class = 1; class <= BEST_SLAB_CLASSES; class++) {
+    best_slab_t *slab = &best_heap.slabs[class - 1];
+    if (!slab->size) {
+      slab->size = size;
+      slab->free_head = NULL;
+      slab->free_count = 0;
+      slab->live_count = 0;
+      slab->pinned = false;
+      best_heap.slab_index[size / 8] = class;
+      return;
+    }
+  }
+}
+
+// Recompute the hot sizes from the histogram, demote the slabs that have
+// cooled down and promote the new hot sizes.
+void best_retune_slabs() {
+  size_t hot[BEST_SLAB_CLASSES];
+  int hot_count = 0;
+  for (int i = 0; i < BEST_HISTOGRAM_SIZE; i++) {
+    if (best_heap.histogram[i] * BEST_HOT_SHARE < best_heap.samples) {
+      continue;
+    }
+    // Keep the hottest BEST_SLAB_CLASSES sizes.
+    int slot = hot_count;
+    if (hot_count < BEST_SLAB_CLASSES) {
+      hot_count++;
+    } else if (best_heap.histogram[i] <= best_heap.histogram[hot[slot - 1] / 8]) {
+      continue;
+    } else {
+      slot--;
+    }
+    while (slot > 0 &&
+           best_heap.histogram[hot[slot - 1] / 8] < best_heap.histogram[i]) {
+      hot[slot] = hot[slot - 1];
+      slot--;
+    }
+    hot[slot] = i * 8;
+  }
+
+  for (int class = 1; class <= BEST_SLAB_CLASSES; class++) {
+    size_t size = best_heap.slabs[class - 1].size;
+    if (!size || best_heap.slabs[class - 1].pinned) {
+      continue;
+    }
+    bool still_hot = false;
+    for (int i = 0; i < hot_count; i++) {
+      still_hot |= hot[i] == size;
+    }
+    if (!still_hot) {
+      best_demote_slab(class);
+    }
+  }
+  for (int i = 0; i < hot_count; i++) {
+    if (!best_heap.slab_index[hot[i] / 8]) {
+      best_promote_slab(hot[i]);
+    }
+  }
+
+  for (int i = 0; i < BEST_HISTOGRAM_SIZE; i++) {
+    best_heap.histogram[i] /= 2;
+  }
+  best_heap.samples /= 2;
+}
+
+// Record one in BEST_SAMPLE_INTERVAL requested sizes.
+void best_sample_size(size_t size) {
+  if (--best_heap.sample_countdown) {
+    return;
+  }
+  best_heap.sample_countdown = BEST_SAMPLE_INTERVAL;
+  if (size / 8 >= BEST_HISTOGRAM_SIZE) {
+    return;
+  }
+  best_heap.histogram[size / 8]++;
+  best_heap.samples++;
+  if (best_heap.samples % BEST_RETUNE_INTERVAL == 0) {
+    best_retune_slabs();
+  }
+}
+
+// Override the tunable parameters. They stay in effect for the following
+// challenges. |static_class_sizes| must be multiples of 8 in [8, 4000].
+void best_configure(size_t region_size, size_t split_threshold, size_t slab_chunk_size,
+                    size_t slab_max_free, int static_class_count,
+                    const size_t *static_class_sizes) {
+  assert(region_size % 4096 == 0);
+  assert(split_threshold >= sizeof(best_metadata_t));
+  assert(static_class_count <= BEST_SLAB_CLASSES);
+  best_heap.config.region_size = region_size;
+  best_heap.config.split_threshold = split_threshold;
+  best_heap.config.slab_chunk_size = slab_chunk_size;
+  best_heap.config.slab_max_free = slab_max_free;
+  best_heap.config.static_class_count = static_class_count;
+  for (int i = 0; i < static_class_count; i++) {
+    best_heap.config.static_class_sizes[i] = static_class_sizes[i];
+  }
+}
+
+#ifdef ENABLE_BEST_HEAP_PROFILE
+// Return a sample of the exponential distribution with mean |mean|, the
+// distance in bytes to the next sampled malloc. -ln(u) is computed from a
+// piecewise-linear log2, which is accurate enough for sampling and needs no
+// library function.
+long long best_next_sample_distance(double mean) {
+  uint64_t x = best_heap.profile.random_state;
+  x ^= x << 13;
+  x ^= x >> 7;
+  x ^= x << 17;
+  best_heap.profile.random_state = x;
+  uint64_t u = (x >> 11) + 1;  // In [1, 2^53]
+  int exponent = 63 - __builtin_clzll(u);
+  double log2_u = exponent + (double)(u - (1ULL << exponent)) / (1ULL << exponent);
+  return (long long)((53 - log2_u) * 0.6931471805599453 * mean) + 1;
+}
+#endif
+
+// Copy the counters to the statistics page, if one is attached. This is called
+// at the end of each challenge, and by the owner of the page whenever it
+// wants a fresher snapshot, e.g. at the end of each epoch, never from
+// malloc or free.
+void best_publish_stats() {
+  best_stats_page_t *page = best_heap.stats_page;
+  if (!page) {
+    return;
+  }
+  uint64_t sequence = page->sequence;
+  __atomic_store_n(&page->sequence, sequence + 1, __ATOMIC_RELAXED);
+  __atomic_thread_fence(__ATOMIC_RELEASE);
+  size_t slab_free_size = 0;
+  for (int i = 0; i < BEST_SLAB_CLASSES; i++) {
+    best_slab_t *slab = &best_heap.slabs[i];
+    slab_free_size += slab->free_count * slab->size;
+    page->classes[i].size = slab->size;
+    page->classes[i].free_slots = slab->free_count;
+    page->classes[i].live_slots = slab->live_count;
+  }
+  page->mapped_size = best_heap.counters.mapped_size;
+  page->live_size = best_heap.counters.live_size;
+  page->free_size = best_heap.counters.tree_free_size + slab_free_size;
+  page->free_block_count = best_heap.counters.tree_free_count;
+  for (int i = 0; i < 2; i++) {
+    // The trees are empty until the first best_initialize().
+    best_metadata_t *root = best_heap.trees[i].free_head;
+    page->tree_height[i] = root ? root->height : 0;
+  }
+  page->malloc_count = best_heap.counters.malloc_count;
+  page->free_count = best_heap.counters.free_count;
+  page->slow_path_count = best_heap.slow_path_count;
+  __atomic_store_n(&page->sequence, sequence + 2, __ATOMIC_RELEASE);
+}
+
+// Publish the counters to |page| from now on, or stop with NULL. The page
+// stays attached across challenges.
+void best_attach_stats_page(best_stats_page_t *page) {
+  best_heap.stats_page = page;
+  if (page) {
+    page->magic = BEST_STATS_MAGIC;
+    page->version = BEST_STATS_VERSION;
+    best_publish_stats();
+  }
+}
+
+// Guard the entry points against a dump requested by a signal while the heap
+// is inconsistent. The signal fences keep the compiler from moving heap
+// accesses across the flag.
+void best_write_pending_dump();
+void best_refill_reserve();
+size_t best_reserve_region_size();
+
+void best_enter() {
+  best_heap.in_allocator = true;
+  __atomic_signal_fence(__ATOMIC_SEQ_CST);
+}
+
+void best_leave() {
+  __atomic_signal_fence(__ATOMIC_SEQ_CST);
+  best_heap.in_allocator = false;
+  __atomic_signal_fence(__ATOMIC_SEQ_CST);
+  if (__builtin_expect(best_heap.dump_pending, 0)) {
+    best_write_pending_dump();
+  }
 }
 
 // This is called at the beginning of each challenge.
 void best_initialize() {
-  best_tree.free_head = &best_tree.dummy;
-  best_tree.dummy.size = 0;
-  best_tree.dummy.left = NULL;
-  best_tree.dummy.right = NULL;
-  best_tree.dummy.height = 1;
+  best_enter();
+  if (!best_heap.config.region_size) {
+    size_t static_class_sizes[] = BEST_STATIC_CLASS_SIZES;
+    best_configure(BEST_REGION_SIZE, BEST_SPLIT_THRESHOLD, BEST_SLAB_CHUNK_SIZE,
+                   BEST_SLAB_MAX_FREE, BEST_STATIC_CLASS_COUNT, static_class_sizes);
+  }
+  for (int i = 0; i < 2; i++) {
+    best_tree_t *tree = &best_heap.trees[i];
+    tree->free_head = &tree->dummy;
+    tree->dummy.size = 0;
+    tree->dummy.left = NULL;
+    tree->dummy.right = NULL;
+    tree->dummy.height = 1;
+    tree->dummy.kind = i ? BEST_KIND_LONG_LIVED : 0;
+  }
+  for (int class = 1; class <= BEST_SLAB_CLASSES; class++) {
+    best_heap.slabs[class - 1].size = 0;
+    best_heap.slabs[class - 1].free_head = NULL;
+    best_heap.slabs[class - 1].free_count = 0;
+    best_heap.slabs[class - 1].live_count = 0;
+  }
+  best_heap.counters.mapped_size = 0;
+  best_heap.counters.live_size = 0;
+  best_heap.counters.tree_free_size = 0;
+  best_heap.counters.tree_free_count = 0;
+  best_heap.counters.malloc_count = 0;
+  best_heap.counters.free_count = 0;
+  best_heap.region_count = 0;
+  best_heap.untracked_region_count = 0;
+  best_heap.reserve_head = NULL;
+  best_heap.reserve_region_size = best_reserve_region_size();
+  best_heap.reserve_count = 0;
+  best_heap.reserve_target = BEST_RESERVE_MIN_REGIONS;
+  best_heap.reserve_demand_count = 0;
+  for (int i = 0; i < BEST_HISTOGRAM_SIZE; i++) {
+    best_heap.slab_index[i] = 0;
+    best_heap.histogram[i] = 0;
+  }
+  best_heap.sample_countdown = BEST_SAMPLE_INTERVAL;
+  best_heap.samples = 0;
+  best_heap.slow_path_count = 0;
+  best_heap.clock = 0;
+  for (int i = 0; i < BEST_SITES; i++) {
+    best_heap.sites[i].address = NULL;
+  }
+#ifdef ENABLE_BEST_HEAP_PROFILE
+  best_heap.profile.random_state = 0x2545f4914f6cdd1dULL;
+  best_heap.profile.bytes_until_sample = best_next_sample_distance(BEST_PROFILE_RATE);
+  best_heap.profile.sample_count = 0;
+  best_heap.profile.dropped_count = 0;
+  best_heap.profile.next_index = 0;
+  for (int i = 0; i < BEST_PROFILE_SAMPLES; i++) {
+    best_heap.profile.samples[i].ptr = NULL;
+    best_heap.profile.samples[i].size = 0;
+  }
+#endif
+  for (int i = 0; i < best_heap.config.static_class_count; i++) {
+    best_promote_slab(best_heap.config.static_class_sizes[i]);
+    best_heap.slabs[i].pinned = true;
+  }
+  best_leave();
+  best_refill_reserve();
 }
 
-// best_malloc() is called every time an object is allocated.
-// |size| is guaranteed to be a multiple of 8 bytes and meets 8 <= |size| <=
-// 4000. You are not allowed to use any library functions other than
-// mmap_from_system() / munmap_to_system().
-void *best_malloc(size_t size) {
-  best_metadata_t *metadata = best_tree.free_head;
+// Return the size of the largest buffer best_tree_malloc() maps: a region,
+// the metadata and the largest object rounded up to pages, or a slab chunk.
+size_t best_reserve_region_size() {
+  size_t size = sizeof(best_metadata_t) + 4000;
+  if (size < best_heap.config.slab_chunk_size) {
+    size = best_heap.config.slab_chunk_size;
+  }
+  size = (size + 4095) / 4096 * 4096;
+  return size < best_heap.config.region_size ? best_heap.config.region_size : size;
+}
+
+// Pop a region from the real-time reserve, or return NULL if it is empty.
+best_metadata_t *best_take_reserve() {
+  best_metadata_t *region = best_heap.reserve_head;
+  best_heap.reserve_demand_count++;
+  if (region) {
+    best_heap.reserve_head = region->left;
+    best_heap.reserve_count--;
+  }
+  return region;
+}
+
+// Top the real-time reserve up if it is below its low watermark. This maps
+// and touches memory, so call it outside the latency-critical path.
+void best_refill_reserve() {
+  if (!best_heap.reserve_enabled) {
+    return;
+  }
+  best_enter();
+  if (best_heap.reserve_demand_count * 2 > best_heap.reserve_target) {
+    best_heap.reserve_target = best_heap.reserve_demand_count * 2;
+  }
+  best_heap.reserve_demand_count = 0;
+  if (best_heap.reserve_count * 2 < best_heap.reserve_target) {
+    size_t region_size = best_heap.reserve_region_size;
+    size_t count = best_heap.reserve_target - best_heap.reserve_count;
+    char *buffer = (char *)mmap_from_system(count * region_size);
+    if (buffer) {
+      // Fault every page in now rather than in a later malloc.
+      for (size_t offset = 0; offset < count * region_size; offset += 4096) {
+        ((volatile char *)buffer)[offset] = 0;
+      }
+      for (size_t i = 0; i < count; i++) {
+        best_metadata_t *region = (best_metadata_t *)(buffer + i * region_size);
+        region->left = best_heap.reserve_head;
+        best_heap.reserve_head = region;
+      }
+      best_heap.reserve_count += count;
+    }
+  }
+  best_leave();
+}
+
+// Serve the regions of the tree from the real-time reserve from the next
+// best_initialize() on, or stop with false.
+void best_set_reserve(bool enabled) {
+  best_heap.reserve_enabled = enabled;
+}
+
+// Return the smallest free slot of the tree of |kind| the object fits, or NULL
+// if there is none.
+best_metadata_t *best_find_in_tree(int kind, size_t size) {
+  best_metadata_t *metadata = best_tree_of(kind)->free_head;
   best_metadata_t *best = NULL;
-  // Find the first free slot the object fits.
   while (metadata) {
     if (metadata->size < size) {
       metadata = metadata->right;
@@ -122,7 +890,13 @@ void *best_malloc(size_t size) {
       metadata = metadata->left;
     }
   }
-  // now, metadata points to the first free slot
+  return best;
+}
+
+// Allocate an object of |size| bytes from the best-fit tree of |kind|.
+void *best_tree_malloc(int kind, size_t size) {
+  best_metadata_t *metadata;
+  best_metadata_t *best = best_find_in_tree(kind, size);
 
   if (!best) {
     // There was no free slot available. We need to request a new memory region
@@ -133,16 +907,45 @@ void *best_malloc(size_t size) {
     //     metadata
     //     <---------------------->
     //            buffer_size
-    size_t buffer_size = 4096;
-    metadata = (best_metadata_t *)mmap_from_system(buffer_size);
+    //
+    // The region is larger than the configured size if the object does not
+    // fit otherwise. A region from the real-time reserve fits any object.
+    size_t buffer_size = best_heap.config.region_size;
+    if (buffer_size < sizeof(best_metadata_t) + size) {
+      buffer_size = (sizeof(best_metadata_t) + size + 4095) / 4096 * 4096;
+    }
+    metadata = best_take_reserve();
+    if (metadata) {
+      buffer_size = best_heap.reserve_region_size;
+    } else {
+      metadata = (best_metadata_t *)mmap_from_system(buffer_size);
+    }
+    if (!metadata) {
+      // The memory budget is exhausted. Reclaim what we can and retry once,
+      // from the merged slots or with the pages that were unmapped.
+      best_reclaim();
+      best = best_find_in_tree(kind, size);
+      if (best) {
+        return best_tree_malloc(kind, size);
+      }
+      metadata = (best_metadata_t *)mmap_from_system(buffer_size);
+      if (!metadata) {
+        return NULL;
+      }
+    }
+    MALLOC_HOOK(on_map, metadata, buffer_size);
+    BEST_PROBE(region_map, metadata, buffer_size);
+    best_add_region(metadata, buffer_size);
+    best_heap.counters.mapped_size += buffer_size;
     metadata->size = buffer_size - sizeof(best_metadata_t);
     metadata->left = NULL;
     metadata->right = NULL;
     metadata->height = 1;
+    metadata->kind = kind;
     // Add the memory region to the free list.
     best_insert_to_tree(metadata);
-    // Now, try best_malloc() again. This should succeed.
-    return best_malloc(size);
+    // Now, try best_tree_malloc() again. This should succeed.
+    return best_tree_malloc(kind, size);
   }
 
   // |ptr| is the beginning of the allocated object.
@@ -158,7 +961,7 @@ void *best_malloc(size_t size) {
   best->right = NULL;
   best->height = 1;
 
-  if (remaining_size > sizeof(best_metadata_t)) {
+  if (remaining_size > best_heap.config.split_threshold) {
     // Shrink the metadata for the allocated object
     // to separate the rest of the region corresponding to remaining_size.
     // If the remaining_size is not large enough to make a new metadata,
@@ -177,12 +980,236 @@ void *best_malloc(size_t size) {
     new_metadata->left = NULL;
     new_metadata->right = NULL;
     new_metadata->height = 1;
+    new_metadata->kind = kind;
     // Add the remaining free slot to the free list.
     best_insert_to_tree(new_metadata);
   }
   return ptr;
 }
 
+// Refill the free list of a slab. Free slots the tree already has are reused
+// one at a time, so that memory freed before the size became hot is not
+// stranded. Otherwise a chunk taken from the tree is carved into as many slots
+// as fit in the configured chunk size.
+//
+// | metadata | slot | metadata | slot | ... | metadata | slot |
+// ^
+// chunk (the chunk's metadata is reused by the first slot)
+void best_refill_slab(best_slab_t *slab, int class) {
+  size_t slot_size = sizeof(best_metadata_t) + slab->size;
+  size_t count = best_heap.config.slab_chunk_size / slot_size;
+  if (count == 0) {
+    count = 1;
+  }
+  best_metadata_t *best = best_find_in_tree(0, slab->size);
+  void *chunk_ptr = NULL;
+  if (!best || best->size >= count * slot_size - sizeof(best_metadata_t)) {
+    chunk_ptr = best_tree_malloc(0, count * slot_size - sizeof(best_metadata_t));
+  }
+  if (!chunk_ptr) {
+    // Reuse the free slot, or take a single slot if a whole chunk does not
+    // fit in the memory budget.
+    void *ptr = best_tree_malloc(0, slab->size);
+    if (!ptr) {
+      return;
+    }
+    best_metadata_t *metadata = (best_metadata_t *)ptr - 1;
+    // If the slot was not split, its size differs from the slab's and it will
+    // return to the tree when freed.
+    metadata->kind = class;
+    metadata->left = NULL;
+    slab->free_head = metadata;
+    slab->free_count = 1;
+    return;
+  }
+  best_metadata_t *chunk = (best_metadata_t *)chunk_ptr - 1;
+  for (size_t i = 0; i < count; i++) {
+    best_metadata_t *metadata =
+        (best_metadata_t *)((char *)chunk + i * slot_size);
+    metadata->size = slab->size;
+    metadata->kind = class;
+    metadata->left = slab->free_head;
+    slab->free_head = metadata;
+  }
+  slab->free_count = count;
+}
+
+// Allocate an object of |size| bytes from a slab or the regular tree.
+void *best_malloc_short_lived(size_t size) {
+  best_sample_size(size);
+  int class = size / 8 < BEST_HISTOGRAM_SIZE ? best_heap.slab_index[size / 8] : 0;
+  if (!class) {
+    best_heap.slow_path_count++;
+    return best_tree_malloc(0, size);
+  }
+  // Fast path: pop a slot from the exact-size slab.
+  best_slab_t *slab = &best_heap.slabs[class - 1];
+  if (!slab->free_head) {
+    best_heap.slow_path_count++;
+    best_refill_slab(slab, class);
+    if (!slab->free_head) {
+      return NULL;
+    }
+  }
+  best_metadata_t *metadata = slab->free_head;
+  slab->free_head = metadata->left;
+  slab->free_count--;
+  slab->live_count++;
+  metadata->left = NULL;
+  return metadata + 1;
+}
+
+#ifdef ENABLE_BEST_SITE_PREDICTION
+// Return the site of |address|, registering it if it is new, or 0 if the
+// table is full.
+int best_find_site(void *address) {
+  size_t index = ((uintptr_t)address >> 2) * 0x9e3779b97f4a7c15ULL >> 58;
+  for (int i = 0; i < BEST_SITES; i++) {
+    best_site_t *site = &best_heap.sites[(index + i) % BEST_SITES];
+    if (site->address == address) {
+      return (index + i) % BEST_SITES + 1;
+    }
+    if (!site->address) {
+      site->address = address;
+      site->first_seen = best_heap.clock;
+      site->alloc_count = site->free_count = 0;
+      site->short_count = site->long_count = 0;
+      return (index + i) % BEST_SITES + 1;
+    }
+  }
+  return 0;
+}
+
+// Predict whether the next object of |site| lives longer than
+// BEST_LONG_LIFETIME.
+bool best_is_long_lived(int site_index) {
+  best_site_t *site = &best_heap.sites[site_index - 1];
+  if (site->short_count + site->long_count >= BEST_SITE_MIN_SAMPLES) {
+    return site->long_count > site->short_count;
+  }
+  // Objects that are never freed give no samples. A site whose objects are
+  // mostly still alive long after it was first seen is long-lived as well.
+  return best_heap.clock - site->first_seen > BEST_LONG_LIFETIME &&
+         site->alloc_count >= BEST_SITE_MIN_SAMPLES &&
+         site->free_count * 4 < site->alloc_count;
+}
+
+// Record the lifetime of an object of |site| that is being freed.
+void best_record_lifetime(best_metadata_t *metadata) {
+  if (!metadata->site) {
+    return;
+  }
+  best_site_t *site = &best_heap.sites[metadata->site - 1];
+  site->free_count++;
+  if (best_heap.clock - metadata->birth > BEST_LONG_LIFETIME) {
+    site->long_count++;
+  } else {
+    site->short_count++;
+  }
+  // Forget old samples so that the prediction follows the workload.
+  if (site->short_count + site->long_count >= BEST_SITE_WINDOW) {
+    site->short_count /= 2;
+    site->long_count /= 2;
+  }
+}
+#endif
+
+#ifdef ENABLE_BEST_HEAP_PROFILE
+// Record a sample of the object at |ptr|. This is kept out of line so that
+// the frame walk can skip exactly one frame, the one in best_malloc().
+__attribute__((noinline)) void best_profile_sample(void *ptr, size_t size) {
+  best_profile_t *profile = &best_heap.profile;
+  profile->bytes_until_sample = best_next_sample_distance(BEST_PROFILE_RATE);
+  // Take the next entry whose object is gone, so that freed samples are
+  // replaced in the order they were taken and live ones are kept.
+  int index = profile->next_index;
+  while (profile->samples[index].ptr) {
+    index = (index + 1) % BEST_PROFILE_SAMPLES;
+    if (index == profile->next_index) {
+      profile->dropped_count++;
+      return;
+    }
+  }
+  profile->next_index = (index + 1) % BEST_PROFILE_SAMPLES;
+  profile->sample_count++;
+  best_sample_t *sample = &profile->samples[index];
+  sample->ptr = ptr;
+  sample->size = size;
+  sample->timestamp = best_heap.clock;
+  sample->depth = 0;
+  ((best_metadata_t *)ptr - 1)->height = index + 1;
+
+  // Each frame starts with the caller's frame pointer followed by the return
+  // address. Frames live at increasing addresses; anything else means the
+  // chain is broken.
+  void **frame = (void **)__builtin_frame_address(0);
+  bool skip = true;
+  while (sample->depth < BEST_PROFILE_DEPTH && frame[1]) {
+    if (!skip) {
+      sample->stack[sample->depth++] = frame[1];
+    }
+    skip = false;
+    void **next = (void **)frame[0];
+    if (next <= frame || (uintptr_t)next % sizeof(void *) ||
+        (char *)next - (char *)frame > BEST_PROFILE_MAX_FRAME_SIZE) {
+      break;
+    }
+    frame = next;
+  }
+}
+#endif
+
+// best_malloc() is called every time an object is allocated.
+// |size| is guaranteed to be a multiple of 8 bytes and meets 8 <= |size| <=
+// 4000. You are not allowed to use any library functions other than
+// mmap_from_system() / munmap_to_system().
+void *best_malloc(size_t size) {
+  BEST_PROBE(malloc_entry, size);
+  best_enter();
+#if defined(ENABLE_BEST_SITE_PREDICTION) || defined(ENABLE_BEST_HEAP_PROFILE)
+  best_heap.clock++;
+#endif
+#ifdef ENABLE_BEST_SITE_PREDICTION
+  int site = best_find_site(__builtin_return_address(0));
+  void *ptr;
+  if (site && best_is_long_lived(site)) {
+    best_heap.slow_path_count++;
+    ptr = best_tree_malloc(BEST_KIND_LONG_LIVED, size);
+  } else {
+    ptr = best_malloc_short_lived(size);
+  }
+  if (!ptr) {
+    best_leave();
+    return NULL;
+  }
+  if (site) {
+    best_heap.sites[site - 1].alloc_count++;
+  }
+  best_metadata_t *metadata = (best_metadata_t *)ptr - 1;
+  metadata->birth = best_heap.clock;
+  metadata->site = site;
+#else
+  void *ptr = best_malloc_short_lived(size);
+  if (!ptr) {
+    best_leave();
+    return NULL;
+  }
+#endif
+#ifdef ENABLE_BEST_HEAP_PROFILE
+  ((best_metadata_t *)ptr - 1)->height = 0;
+  best_heap.profile.bytes_until_sample -= size;
+  if (best_heap.profile.bytes_until_sample < 0) {
+    best_profile_sample(ptr, size);
+  }
+#endif
+  best_heap.counters.malloc_count++;
+  best_heap.counters.live_size += ((best_metadata_t *)ptr - 1)->size;
+  best_leave();
+  BEST_PROBE(malloc_exit, ptr, size);
+  MALLOC_HOOK(on_malloc, ptr, size);
+  return ptr;
+}
+
 // This is called every time an object is freed.  You are not allowed to
 // use any library functions other than mmap_from_system / munmap_to_system.
 void best_free(void *ptr) {
@@ -192,9 +1219,250 @@ void best_free(void *ptr) {
   //     ^          ^
   //     metadata   ptr
   best_metadata_t *metadata = (best_metadata_t *)ptr - 1;
+  MALLOC_HOOK(on_free, ptr, metadata->size);
+  best_enter();
+  best_heap.counters.free_count++;
+  best_heap.counters.live_size -= metadata->size;
+#ifdef ENABLE_BEST_SITE_PREDICTION
+  best_record_lifetime(metadata);
+#endif
+#ifdef ENABLE_BEST_HEAP_PROFILE
+  if (metadata->height > 0) {
+    // The entry is reused only after the object is freed, so it is still
+    // this object's sample.
+    best_sample_t *sample = &best_heap.profile.samples[metadata->height - 1];
+    sample->ptr = NULL;
+  }
+#endif
+  // A slot of a slab that is still active goes back to the slab unless the
+  // slab already keeps enough free slots. Slots of a demoted slab fall through
+  // to the tree. Long-lived slots (BEST_KIND_LONG_LIVED) keep their kind and
+  // go back to the long-lived tree.
+  if (metadata->kind > 0) {
+    best_slab_t *slab = &best_heap.slabs[metadata->kind - 1];
+    if (slab->live_count) {
+      slab->live_count--;
+    }
+    if (slab->size == metadata->size &&
+        slab->free_count < best_heap.config.slab_max_free) {
+      metadata->left = slab->free_head;
+      slab->free_head = metadata;
+      slab->free_count++;
+      best_leave();
+      return;
+    }
+    metadata->kind = 0;
+  }
+  // Slots carved from a chunk have no tree links yet, and the links of an
+  // allocated object may hold its site.
+  metadata->left = NULL;
+  metadata->right = NULL;
+  metadata->height = 1;
   // Add the free slot to the free list.
   best_insert_to_tree(metadata);
+  best_leave();
 }
 
+// Helpers to format a dump without library functions. |write_func| receives
+// the text piece by piece.
+typedef void (*best_write_func_t)(const char *data, size_t size);
+
+void best_write_string(best_write_func_t write_func, const char *string) {
+  size_t length = 0;
+  while (string[length]) {
+    length++;
+  }
+  write_func(string, length);
+}
+
+void best_write_number(best_write_func_t write_func, uint64_t value, int base) {
+  char buffer[24];
+  int i = sizeof(buffer);
+  do {
+    buffer[--i] = "0123456789abcdef"[value % base];
+    value /= base;
+  } while (value);
+  if (base == 16) {
+    buffer[--i] = 'x';
+    buffer[--i] = '0';
+  }
+  write_func(buffer + i, sizeof(buffer) - i);
+}
+
+#ifdef ENABLE_BEST_HEAP_PROFILE
+// Write the samples as a pprof legacy heap profile (heap_v2), in which pprof
+// scales every sample back up by the sampling rate. Live samples count as in
+// use; freed samples still in the ring only count as allocated. The number
+// of dropped samples follows the header as a comment, which pprof skips. Only
+// the profile itself is written: the caller appends the MAPPED_LIBRARIES
+// section from /proc/self/maps, which best_malloc cannot read.
+void best_dump_heap_profile(best_write_func_t write_func) {
+  best_profile_t *profile = &best_heap.profile;
+  size_t count = 0, live_count = 0, live_size = 0, alloc_size = 0;
+  for (int i = 0; i < BEST_PROFILE_SAMPLES; i++) {
+    if (!profile->samples[i].size) {
+      continue;
+    }
+    count++;
+    alloc_size += profile->samples[i].size;
+    if (profile->samples[i].ptr) {
+      live_count++;
+      live_size += profile->samples[i].size;
+    }
+  }
+  best_write_string(write_func, "heap profile: ");
+  best_write_number(write_func, live_count, 10);
+  best_write_string(write_func, ": ");
+  best_write_number(write_func, live_size, 10);
+  best_write_string(write_func, " [");
+  best_write_number(write_func, count, 10);
+  best_write_string(write_func, ": ");
+  best_write_number(write_func, alloc_size, 10);
+  best_write_string(write_func, "] @ heap_v2/");
+  best_write_number(write_func, BEST_PROFILE_RATE, 10);
+  best_write_string(write_func, "\n# dropped samples: ");
+  best_write_number(write_func, profile->dropped_count, 10);
+  best_write_string(write_func, "\n");
+  for (int i = 0; i < BEST_PROFILE_SAMPLES; i++) {
+    best_sample_t *sample = &profile->samples[i];
+    if (!sample->size) {
+      continue;
+    }
+    bool live = sample->ptr != NULL;
+    best_write_number(write_func, live, 10);
+    best_write_string(write_func, ": ");
+    best_write_number(write_func, live ? sample->size : 0, 10);
+    best_write_string(write_func, " [1: ");
+    best_write_number(write_func, sample->size, 10);
+    best_write_string(write_func, "] @");
+    for (int j = 0; j < sample->depth; j++) {
+      best_write_string(write_func, " ");
+      best_write_number(write_func, (uintptr_t)sample->stack[j], 16);
+    }
+    best_write_string(write_func, "\n");
+  }
+}
+#endif
+
+// Count the free slots of |tree| into |histogram| by the power of two of their
+// size, and return the number of slots.
+size_t best_count_tree(best_metadata_t *tree, best_metadata_t *dummy, size_t *histogram) {
+  if (!tree) {
+    return 0;
+  }
+  size_t count = 0;
+  if (tree != dummy) {
+    int bucket = 0;
+    while (bucket < BEST_DUMP_BUCKETS - 1 && ((size_t)2 << bucket) <= tree->size) {
+      bucket++;
+    }
+    histogram[bucket]++;
+    count++;
+  }
+  return count + best_count_tree(tree->left, dummy, histogram) +
+         best_count_tree(tree->right, dummy, histogram);
+}
+
+void best_write_field(best_write_func_t write_func, const char *name, uint64_t value) {
+  best_write_string(write_func, name);
+  best_write_number(write_func, value, 10);
+  best_write_string(write_func, "\n");
+}
+
+// Write the mapped regions, the shape of the trees, the slabs and the counters
+// as text. This may run in a signal handler, so it only reads the heap and
+// formats with the helpers above.
+void best_write_state(best_write_func_t write_func, bool deferred) {
+  best_write_string(write_func, deferred ? "best_malloc state (deferred)\n"
+                                         : "best_malloc state\n");
+  best_write_field(write_func, "mapped_size ", best_heap.counters.mapped_size);
+  best_write_field(write_func, "live_size ", best_heap.counters.live_size);
+  best_write_field(write_func, "tree_free_size ", best_heap.counters.tree_free_size);
+  best_write_field(write_func, "malloc_count ", best_heap.counters.malloc_count);
+  best_write_field(write_func, "free_count ", best_heap.counters.free_count);
+  best_write_field(write_func, "slow_path_count ", best_heap.slow_path_count);
+  best_write_field(write_func, "regions ", best_heap.region_count);
+  best_write_field(write_func, "untracked_regions ", best_heap.untracked_region_count);
+  if (best_heap.reserve_enabled) {
+    best_write_field(write_func, "reserve_regions ", best_heap.reserve_count);
+    best_write_field(write_func, "reserve_target ", best_heap.reserve_target);
+  }
+  for (int i = 0; i < best_heap.region_count; i++) {
+    best_write_string(write_func, "  region ");
+    best_write_number(write_func, best_heap.regions[i].start, 16);
+    best_write_string(write_func, " ");
+    best_write_number(write_func, best_heap.regions[i].size, 10);
+    best_write_string(write_func, "\n");
+  }
+  for (int i = 0; i < 2; i++) {
+    best_tree_t *tree = &best_heap.trees[i];
+    size_t histogram[BEST_DUMP_BUCKETS] = {0};
+    size_t count = best_count_tree(tree->free_head, &tree->dummy, histogram);
+    best_write_string(write_func, i ? "tree long_lived" : "tree regular");
+    best_write_string(write_func, " height ");
+    // The trees are empty until the first best_initialize().
+    best_write_number(write_func, tree->free_head ? tree->free_head->height : 0, 10);
+    best_write_field(write_func, " nodes ", count);
+    for (int bucket = 0; bucket < BEST_DUMP_BUCKETS; bucket++) {
+      if (histogram[bucket]) {
+        best_write_string(write_func, "  size >= ");
+        best_write_number(write_func, (size_t)1 << bucket, 10);
+        best_write_field(write_func, ": ", histogram[bucket]);
+      }
+    }
+  }
+  for (int i = 0; i < BEST_SLAB_CLASSES; i++) {
+    best_slab_t *slab = &best_heap.slabs[i];
+    if (!slab->size) {
+      continue;
+    }
+    best_write_string(write_func, "slab ");
+    best_write_number(write_func, slab->size, 10);
+    best_write_string(write_func, " free ");
+    best_write_number(write_func, slab->free_count, 10);
+    best_write_string(write_func, " live ");
+    best_write_number(write_func, slab->live_count, 10);
+    best_write_string(write_func, slab->pinned ? " pinned\n" : "\n");
+  }
+}
+
+// Dump the state with |write_func|, which must be async-signal-safe. This is
+// meant to be called from a signal handler: if the signal interrupted the
+// allocator, the dump is written when the allocator returns instead.
+void best_request_dump(best_write_func_t write_func) {
+  best_heap.dump_write_func = write_func;
+  if (best_heap.in_allocator) {
+    best_heap.dump_pending = true;
+    return;
+  }
+  best_heap.in_allocator = true;
+  __atomic_signal_fence(__ATOMIC_SEQ_CST);
+  best_write_state(write_func, false);
+  __atomic_signal_fence(__ATOMIC_SEQ_CST);
+  best_heap.in_allocator = false;
+}
+
+void best_write_pending_dump() {
+  best_heap.in_allocator = true;
+  best_heap.dump_pending = false;
+  __atomic_signal_fence(__ATOMIC_SEQ_CST);
+  best_write_state(best_heap.dump_write_func, true);
+  __atomic_signal_fence(__ATOMIC_SEQ_CST);
+  best_heap.in_allocator = false;
+}
+
+// Return the number of mallocs in this challenge that took the slow path.
+size_t best_slow_path_count() { return best_heap.slow_path_count; }
+
 // This is called at the end of each challenge.
-void best_finalize() {}
+void best_finalize() {
+  best_enter();
+  while (best_heap.reserve_head) {
+    best_metadata_t *region = best_heap.reserve_head;
+    best_heap.reserve_head = region->left;
+    munmap_to_system(region, best_heap.reserve_region_size);
+  }
+  best_heap.reserve_count = 0;
+  best_leave();
+  best_publish_stats();
+}
@@ -0,0 +1,35 @@
+#ifndef BEST_MALLOC_H
+#define BEST_MALLOC_H
+
+#include <stdbool.h>
+#include <stddef.h>
+
+#include "best_malloc_stats.h"
+
+// The interface of best_malloc, shared by the challenge harness (main.c) and
+// tune_malloc.c.
+
+// The size of the metadata in front of every object. A free slot is split
+// only if more than BEST_SPLIT_THRESHOLD bytes remain, by default just
+// enough for the metadata of the new slot.
+#define BEST_METADATA_SIZE 32
+#ifndef BEST_SPLIT_THRESHOLD
+#define BEST_SPLIT_THRESHOLD BEST_METADATA_SIZE
+#endif
+
+void best_initialize();
+void *best_malloc(size_t size);
+void best_free(void *ptr);
+void best_finalize();
+void best_configure(size_t region_size, size_t split_threshold, size_t slab_chunk_size,
+                    size_t slab_max_free, int static_class_count,
+                    const size_t *static_class_sizes);
+size_t best_slow_path_count();
+void best_attach_stats_page(best_stats_page_t *page);
+void best_publish_stats();
+void best_dump_heap_profile(void (*write_func)(const char *data, size_t size));
+void best_request_dump(void (*write_func)(const char *data, size_t size));
+void best_set_reserve(bool enabled);
+void best_refill_reserve();
+
+#endif
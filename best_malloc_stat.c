@@ -0,0 +1,110 @@
+#include <fcntl.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include "best_malloc_stats.h"
+
+// best_malloc_stat prints the statistics that a running process publishes
+// from best_malloc (start it with BEST_MALLOC_STATS=1).
+//
+//   ./best_malloc_stat.bin <pid> [interval_ms]
+//
+// Without an interval the statistics are printed once. With one, a line is
+// printed every |interval_ms| until the process goes away.
+
+// Copy a consistent snapshot of |page| to |snapshot|. Retries while the
+// writer is in the middle of an update, and gives up after READ_RETRIES
+// attempts in case the writer died in the middle of one.
+#define READ_RETRIES 100000
+
+bool read_stats(const best_stats_page_t *page, best_stats_page_t *snapshot) {
+  for (int retry = 0; retry < READ_RETRIES; retry++) {
+    uint64_t begin = __atomic_load_n(&page->sequence, __ATOMIC_ACQUIRE);
+    if (begin % 2 == 0) {
+      const uint64_t *source = (const uint64_t *)page;
+      uint64_t *destination = (uint64_t *)snapshot;
+      for (size_t i = 0; i < sizeof(best_stats_page_t) / sizeof(uint64_t); i++) {
+        destination[i] = __atomic_load_n(&source[i], __ATOMIC_RELAXED);
+      }
+      __atomic_thread_fence(__ATOMIC_ACQUIRE);
+      if (__atomic_load_n(&page->sequence, __ATOMIC_RELAXED) == begin) {
+        return true;
+      }
+    }
+    usleep(10);
+  }
+  return false;
+}
+
+void print_header() {
+  printf("%10s %10s %10s %8s %6s %10s %10s %10s  %s\n", "mapped[KB]", "live[KB]",
+         "free[KB]", "blocks", "height", "mallocs", "frees", "slow", "classes size:live/free");
+}
+
+void print_stats(const best_stats_page_t *stats) {
+  printf("%10llu %10llu %10llu %8llu %6llu %10llu %10llu %10llu ",
+         (unsigned long long)stats->mapped_size / 1024,
+         (unsigned long long)stats->live_size / 1024,
+         (unsigned long long)stats->free_size / 1024,
+         (unsigned long long)stats->free_block_count,
+         (unsigned long long)stats->tree_height[0],
+         (unsigned long long)stats->malloc_count, (unsigned long long)stats->free_count,
+         (unsigned long long)stats->slow_path_count);
+  for (int i = 0; i < BEST_STATS_CLASSES; i++) {
+    if (stats->classes[i].size) {
+      printf(" %llu:%llu/%llu", (unsigned long long)stats->classes[i].size,
+             (unsigned long long)stats->classes[i].live_slots,
+             (unsigned long long)stats->classes[i].free_slots);
+    }
+  }
+  printf("\n");
+}
+
+int main(int argc, char **argv) {
+  if (argc < 2) {
+    fprintf(stderr, "Usage: %s <pid> [interval_ms]\n", argv[0]);
+    return EXIT_FAILURE;
+  }
+  int pid = atoi(argv[1]);
+  int interval_ms = argc > 2 ? atoi(argv[2]) : 0;
+  char path[64];
+  snprintf(path, sizeof(path), BEST_STATS_PATH_FORMAT, pid);
+  int fd = open(path, O_RDONLY);
+  if (fd < 0) {
+    perror(path);
+    return EXIT_FAILURE;
+  }
+  const best_stats_page_t *page = (const best_stats_page_t *)mmap(
+      NULL, sizeof(best_stats_page_t), PROT_READ, MAP_SHARED, fd, 0);
+  close(fd);
+  if (page == MAP_FAILED) {
+    perror("mmap");
+    return EXIT_FAILURE;
+  }
+  best_stats_page_t stats;
+  if (!read_stats(page, &stats)) {
+    fprintf(stderr, "%s is stuck in the middle of an update\n", path);
+    return EXIT_FAILURE;
+  }
+  if (stats.magic != BEST_STATS_MAGIC || stats.version != BEST_STATS_VERSION) {
+    fprintf(stderr, "%s is not a best_malloc statistics page of version %d\n", path,
+            BEST_STATS_VERSION);
+    return EXIT_FAILURE;
+  }
+  print_header();
+  print_stats(&stats);
+  while (interval_ms > 0 && kill(pid, 0) == 0) {
+    usleep(interval_ms * 1000);
+    if (!read_stats(page, &stats)) {
+      fprintf(stderr, "%s is stuck in the middle of an update\n", path);
+      return EXIT_FAILURE;
+    }
+    print_stats(&stats);
+  }
+  return EXIT_SUCCESS;
+}
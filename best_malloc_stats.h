@@ -0,0 +1,43 @@
+#ifndef BEST_MALLOC_STATS_H
+#define BEST_MALLOC_STATS_H
+
+#include <stdint.h>
+
+// The statistics page that best_malloc publishes for external monitors
+// (see best_malloc_stat.c). The process that owns the allocator maps it from
+// /dev/shm/best_malloc.<pid>, hands it to best_attach_stats_page() and calls
+// best_publish_stats() whenever the page should be refreshed; best_malloc
+// itself only does so at the end of each challenge.
+//
+// The page is written with seqlock semantics: |sequence| is odd while an
+// update is in progress. A reader copies the page, and retries if |sequence|
+// was odd or changed during the copy.
+#define BEST_STATS_MAGIC 0x54534542  // "BEST"
+#define BEST_STATS_VERSION 1
+#define BEST_STATS_CLASSES 4
+#define BEST_STATS_PATH_FORMAT "/dev/shm/best_malloc.%d"
+
+typedef struct best_stats_class_t {
+  uint64_t size;        // 0 if the class is unused.
+  uint64_t free_slots;  // Free slots kept by the slab.
+  // Slots handed out and not freed since the class was promoted. Slots
+  // still live from before a demotion make this approximate.
+  uint64_t live_slots;
+} best_stats_class_t;
+
+typedef struct best_stats_page_t {
+  uint32_t magic;
+  uint32_t version;
+  uint64_t sequence;
+  uint64_t mapped_size;       // Bytes mapped from the system.
+  uint64_t live_size;         // Usable bytes of the live objects.
+  uint64_t free_size;         // Bytes of the free slots (trees and slabs).
+  uint64_t free_block_count;  // Free slots in the trees.
+  uint64_t tree_height[2];    // Regular and long-lived trees.
+  uint64_t malloc_count;
+  uint64_t free_count;
+  uint64_t slow_path_count;
+  best_stats_class_t classes[BEST_STATS_CLASSES];
+} best_stats_page_t;
+
+#endif
@@ -0,0 +1,95 @@
+#include <assert.h>
+#include <stdio.h>
+#include <sys/mman.h>
+
+// Checks of best_malloc internals that the challenges cannot observe. The
+// allocator is included so that the test can reach |best_heap|.
+#include "best_malloc.c"
+
+// The mappings made and removed, to see which requests reach the system.
+size_t mmap_count;
+size_t munmap_count;
+
+void *mmap_from_system(size_t size) {
+  mmap_count++;
+  void *ptr = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  assert(ptr != MAP_FAILED);
+  return ptr;
+}
+
+void munmap_to_system(void *ptr, size_t size) {
+  munmap_count++;
+  munmap(ptr, size);
+}
+
+// Return whether |metadata| is a node of |tree|.
+bool tree_contains(best_metadata_t *tree, best_metadata_t *metadata) {
+  return tree && (tree == metadata || tree_contains(tree->left, metadata) ||
+                  tree_contains(tree->right, metadata));
+}
+
+// A freed long-lived object returns to the long-lived tree and leaves the
+// slabs and the configuration alone.
+void test_free_long_lived() {
+  best_initialize();
+  best_config_t config = best_heap.config;
+  void *ptr = best_tree_malloc(BEST_KIND_LONG_LIVED, 64);
+  best_metadata_t *metadata = (best_metadata_t *)ptr - 1;
+  best_free(ptr);
+  assert(memcmp(&config, &best_heap.config, sizeof(config)) == 0);
+  assert(metadata->kind == BEST_KIND_LONG_LIVED);
+  assert(tree_contains(best_heap.trees[1].free_head, metadata));
+  assert(!tree_contains(best_heap.trees[0].free_head, metadata));
+  best_finalize();
+}
+
+// A full sample ring drops new samples instead of overwriting live ones, and
+// a freed sample's entry is the one reused.
+void test_profile_keeps_live_samples() {
+  best_initialize();
+  static void *ptrs[BEST_PROFILE_SAMPLES + 1];
+  for (int i = 0; i <= BEST_PROFILE_SAMPLES; i++) {
+    best_heap.profile.bytes_until_sample = 0;
+    ptrs[i] = best_malloc(8);
+  }
+  assert(best_heap.profile.sample_count == BEST_PROFILE_SAMPLES);
+  assert(best_heap.profile.dropped_count == 1);
+  for (int i = 0; i < BEST_PROFILE_SAMPLES; i++) {
+    assert(best_heap.profile.samples[i].ptr == ptrs[i]);
+  }
+  best_free(ptrs[1]);
+  best_heap.profile.bytes_until_sample = 0;
+  void *ptr = best_malloc(16);
+  assert(best_heap.profile.samples[1].ptr == ptr);
+  assert(best_heap.profile.samples[0].ptr == ptrs[0]);
+  assert(best_heap.profile.dropped_count == 1);
+  best_finalize();
+}
+
+// With the real-time reserve, a slab chunk larger than a region is served
+// from the reserve rather than mapped, and best_finalize() unmaps the rest.
+void test_reserve_serves_chunks() {
+  size_t static_class_sizes[] = {16};
+  best_configure(4096, sizeof(best_metadata_t), 16384, (size_t)-1, 1, static_class_sizes);
+  best_set_reserve(true);
+  best_initialize();
+  assert(best_heap.reserve_region_size == 16384);
+  size_t reserve_count = best_heap.reserve_count;
+  size_t count = mmap_count;
+  best_malloc(16);
+  assert(mmap_count == count);
+  assert(best_heap.reserve_count == reserve_count - 1);
+  count = munmap_count;
+  best_finalize();
+  assert(munmap_count == count + reserve_count - 1);
+  assert(!best_heap.reserve_head);
+  best_set_reserve(false);
+}
+
+int main() {
+  test_free_long_lived();
+  test_profile_keeps_live_samples();
+  test_reserve_serves_chunks();
+  printf("best_malloc_test: OK\n");
+  return 0;
+}
@@ -0,0 +1,70 @@
+#include <assert.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "malloc_hooks.h"
+
+void *mmap_from_system(size_t size);
+void munmap_to_system(void *ptr, size_t size);
+
+// A bump allocator that never reuses memory. Objects are carved one after
+// another from chunks of BUMP_CHUNK_SIZE bytes and free does nothing. Nothing
+// can be faster while still handing out fresh memory, so it gives an upper
+// bound on the speed of a real allocator.
+//
+// The chunks are linked through their first word so that they can be
+// returned to the system in bump_finalize().
+#define BUMP_CHUNK_SIZE (1024 * 1024)
+
+typedef struct bump_chunk_t {
+  struct bump_chunk_t *next;
+} bump_chunk_t;
+
+typedef struct bump_heap_t {
+  bump_chunk_t *chunks;
+  char *current;
+  char *end;
+} bump_heap_t;
+
+bump_heap_t bump_heap;
+
+// This is called at the beginning of each challenge.
+void bump_initialize() {
+  bump_heap.chunks = NULL;
+  bump_heap.current = NULL;
+  bump_heap.end = NULL;
+}
+
+// This is called every time an object is allocated. |size| is guaranteed
+// to be a multiple of 8 bytes and meets 8 <= |size| <= 4000.
+void *bump_malloc(size_t size) {
+  if ((size_t)(bump_heap.end - bump_heap.current) < size) {
+    bump_chunk_t *chunk = (bump_chunk_t *)mmap_from_system(BUMP_CHUNK_SIZE);
+    if (!chunk) {
+      // The memory budget is exhausted.
+      return NULL;
+    }
+    MALLOC_HOOK(on_map, chunk, BUMP_CHUNK_SIZE);
+    chunk->next = bump_heap.chunks;
+    bump_heap.chunks = chunk;
+    bump_heap.current = (char *)(chunk + 1);
+    bump_heap.end = (char *)chunk + BUMP_CHUNK_SIZE;
+  }
+  void *ptr = bump_heap.current;
+  bump_heap.current += size;
+  MALLOC_HOOK(on_malloc, ptr, size);
+  return ptr;
+}
+
+// This is called every time an object is freed. The memory is never reused.
+void bump_free(void *ptr) { MALLOC_HOOK(on_free, ptr, 0); }
+
+// This is called at the end of each challenge.
+void bump_finalize() {
+  while (bump_heap.chunks) {
+    bump_chunk_t *next = bump_heap.chunks->next;
+    MALLOC_HOOK(on_unmap, bump_heap.chunks, BUMP_CHUNK_SIZE);
+    munmap_to_system(bump_heap.chunks, BUMP_CHUNK_SIZE);
+    bump_heap.chunks = next;
+  }
+}
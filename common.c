@@ -1,3 +1,27 @@
+#include "malloc_hooks.h"
+
 int max(int a, int b) {
     return (a > b) ? a : b;
 }
+
+const malloc_hooks_t *malloc_hooks;
+malloc_hooks_t installed_malloc_hooks;
+
+void ignore_malloc_event(void *ptr, size_t size) {}
+
+void set_malloc_hooks(const malloc_hooks_t *hooks) {
+  if (!hooks) {
+    malloc_hooks = NULL;
+    return;
+  }
+  installed_malloc_hooks = *hooks;
+  void (**callbacks[])(void *, size_t) = {
+      &installed_malloc_hooks.on_malloc, &installed_malloc_hooks.on_free,
+      &installed_malloc_hooks.on_map, &installed_malloc_hooks.on_unmap};
+  for (size_t i = 0; i < sizeof(callbacks) / sizeof(callbacks[0]); i++) {
+    if (!*callbacks[i]) {
+      *callbacks[i] = ignore_malloc_event;
+    }
+  }
+  malloc_hooks = &installed_malloc_hooks;
+}
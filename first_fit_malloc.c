@@ -7,6 +7,8 @@
 #include <sys/mman.h>
 #include <sys/time.h>
 
+#include "malloc_hooks.h"
+
 void *mmap_from_system(size_t size);
 void munmap_to_system(void *ptr, size_t size);
 
@@ -59,6 +61,74 @@ void first_fit_remove_from_free_list(first_fit_metadata_t *metadata,
   metadata->next = NULL;
 }
 
+// Sort a list of free slots linked through |next| by address (merge sort).
+first_fit_metadata_t *first_fit_sort_by_address(first_fit_metadata_t *list) {
+  if (!list || !list->next) {
+    return list;
+  }
+  first_fit_metadata_t *slow = list;
+  first_fit_metadata_t *fast = list->next;
+  while (fast && fast->next) {
+    slow = slow->next;
+    fast = fast->next->next;
+  }
+  first_fit_metadata_t *second = slow->next;
+  slow->next = NULL;
+  first_fit_metadata_t *a = first_fit_sort_by_address(list);
+  first_fit_metadata_t *b = first_fit_sort_by_address(second);
+  first_fit_metadata_t head;
+  first_fit_metadata_t *tail = &head;
+  while (a && b) {
+    if (a < b) {
+      tail->next = a;
+      a = a->next;
+    } else {
+      tail->next = b;
+      b = b->next;
+    }
+    tail = tail->next;
+  }
+  tail->next = a ? a : b;
+  return head.next;
+}
+
+// Merge the free slots that are next to each other in memory, and return the
+// slots that cover whole regions to the system. This is called when the
+// memory budget is exhausted, so that a malloc can still succeed from a
+// merged slot or from the memory given back.
+void first_fit_coalesce() {
+  first_fit_metadata_t *list = NULL;
+  for (first_fit_metadata_t *metadata = first_fit_heap.free_head; metadata;) {
+    first_fit_metadata_t *next = metadata->next;
+    if (metadata != &first_fit_heap.dummy) {
+      metadata->next = list;
+      list = metadata;
+    }
+    metadata = next;
+  }
+  list = first_fit_sort_by_address(list);
+  first_fit_heap.free_head = &first_fit_heap.dummy;
+  first_fit_heap.dummy.next = NULL;
+  while (list) {
+    first_fit_metadata_t *metadata = list;
+    list = list->next;
+    // Merge the following slots that start right where this one ends.
+    while (list && (char *)(metadata + 1) + metadata->size == (char *)list) {
+      metadata->size += sizeof(first_fit_metadata_t) + list->size;
+      list = list->next;
+    }
+    size_t span = sizeof(first_fit_metadata_t) + metadata->size;
+    if ((uintptr_t)metadata % 4096 == 0 && span % 4096 == 0) {
+      // The slot covers whole regions, which nothing else points into.
+      MALLOC_HOOK(on_unmap, metadata, span);
+      munmap_to_system(metadata, span);
+      continue;
+    }
+    metadata->next = NULL;
+    first_fit_add_to_free_list(metadata);
+  }
+}
+
 // This is called at the beginning of each challenge.
 void first_fit_initialize() {
   first_fit_heap.free_head = &first_fit_heap.dummy;
@@ -91,6 +161,21 @@ void *first_fit_malloc(size_t size) {
     size_t buffer_size = 4096;
     first_fit_metadata_t *metadata =
         (first_fit_metadata_t *)mmap_from_system(buffer_size);
+    if (!metadata) {
+      // The memory budget is exhausted. Coalesce the free slots and retry
+      // once, from a merged slot or with the regions that were unmapped.
+      first_fit_coalesce();
+      for (metadata = first_fit_heap.free_head; metadata; metadata = metadata->next) {
+        if (metadata->size >= size) {
+          return first_fit_malloc(size);
+        }
+      }
+      metadata = (first_fit_metadata_t *)mmap_from_system(buffer_size);
+      if (!metadata) {
+        return NULL;
+      }
+    }
+    MALLOC_HOOK(on_map, metadata, buffer_size);
     metadata->size = buffer_size - sizeof(first_fit_metadata_t);
     metadata->next = NULL;
     // Add the memory region to the free list.
@@ -129,6 +214,7 @@ void *first_fit_malloc(size_t size) {
     // Add the remaining free slot to the free list.
     first_fit_add_to_free_list(new_metadata);
   }
+  MALLOC_HOOK(on_malloc, ptr, size);
   return ptr;
 }
 
@@ -141,6 +227,7 @@ void first_fit_free(void *ptr) {
   //     ^          ^
   //     metadata   ptr
   first_fit_metadata_t *metadata = (first_fit_metadata_t *)ptr - 1;
+  MALLOC_HOOK(on_free, ptr, metadata->size);
   // Add the free slot to the free list.
   first_fit_add_to_free_list(metadata);
 }
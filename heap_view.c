@@ -0,0 +1,397 @@
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+// heap_view renders the heap occupancy recorded in a malloc trace.
+//
+//   ./heap_view.bin [-o output] [-f html|ppm] [-w width] [-H header_size] trace
+//
+// The trace is replayed byte by byte: 'm' / 'u' events map / unmap pages,
+// 'a' marks the header and the object as used, and 'f' marks them free
+// again. At every 'e' (end of epoch) event a frame is taken, with one row per
+// page that the trace ever mapped, in address order, and |width| pixels per
+// row. Each pixel is coloured by the bytes it covers: unmapped, free, header,
+// allocated, or partially used when free and used bytes are mixed.
+//
+// The frames go to an HTML page with a canvas and an epoch slider (-f html,
+// the default) or to one binary PPM per epoch (-f ppm, output_<epoch>.ppm).
+// A summary of mapped, empty and sparse (less than a quarter used) pages per
+// epoch is printed to stdout.
+//
+// The trace only records the object, not the allocator's header in front of
+// it. |header_size| is guessed from the trace name (16 bytes for first_fit,
+// 32 for best_fit and best) unless it is given.
+
+#define PAGE_SIZE 4096
+
+// The state of each byte of a page, and also the colour of a pixel.
+typedef enum {
+  BYTE_UNMAPPED,
+  BYTE_FREE,
+  BYTE_HEADER,
+  BYTE_ALLOCATED,
+  PIXEL_PARTIAL,
+  STATE_COUNT,
+} state_t;
+
+const unsigned char state_colors[STATE_COUNT][3] = {
+    {0x20, 0x20, 0x20},  // Unmapped
+    {0xe0, 0xe0, 0xe0},  // Free
+    {0xf0, 0xc0, 0x00},  // Header
+    {0xd0, 0x30, 0x30},  // Allocated
+    {0xf0, 0x90, 0x90},  // Partially used
+};
+const char state_chars[STATE_COUNT] = {'u', 'f', 'h', 'a', 'p'};
+const char *state_names[STATE_COUNT] = {"unmapped", "free", "header", "allocated",
+                                        "partially used"};
+
+typedef struct event_t {
+  char type;  // 'm', 'u', 'a', 'f' or 'e'
+  unsigned long long ptr;  // The epoch for 'e'
+  size_t size;
+} event_t;
+
+typedef struct heap_t {
+  // The sorted addresses of the pages ever mapped, one row each.
+  unsigned long long *pages;
+  size_t page_count;
+  // |bytes[i * PAGE_SIZE + j]| is the state of byte j of page i.
+  unsigned char *bytes;
+} heap_t;
+
+// Read the events of a trace. Lines that are not events are skipped.
+event_t *read_trace(const char *file_name, size_t *event_count) {
+  FILE *fp = fopen(file_name, "r");
+  if (!fp) {
+    fprintf(stderr, "Failed to open a trace file: %s\n", file_name);
+    exit(EXIT_FAILURE);
+  }
+  size_t capacity = 1024;
+  event_t *events = (event_t *)malloc(capacity * sizeof(event_t));
+  *event_count = 0;
+  char line[256];
+  while (fgets(line, sizeof(line), fp)) {
+    event_t event;
+    event.size = 0;
+    int fields = sscanf(line, "%c %llu %zu", &event.type, &event.ptr, &event.size);
+    if (event.type == 'e' ? fields < 2 : fields != 3 || !strchr("muaf", event.type)) {
+      continue;
+    }
+    if (*event_count == capacity) {
+      capacity *= 2;
+      events = (event_t *)realloc(events, capacity * sizeof(event_t));
+    }
+    events[(*event_count)++] = event;
+  }
+  fclose(fp);
+  return events;
+}
+
+int compare_pages(const void *a, const void *b) {
+  unsigned long long x = *(const unsigned long long *)a;
+  unsigned long long y = *(const unsigned long long *)b;
+  return x < y ? -1 : x > y;
+}
+
+// Collect the pages mapped by the trace.
+void heap_create(heap_t *heap, const event_t *events, size_t event_count) {
+  size_t capacity = 1024;
+  heap->pages = (unsigned long long *)malloc(capacity * sizeof(unsigned long long));
+  heap->page_count = 0;
+  for (size_t i = 0; i < event_count; i++) {
+    if (events[i].type != 'm') {
+      continue;
+    }
+    for (size_t offset = 0; offset < events[i].size; offset += PAGE_SIZE) {
+      if (heap->page_count == capacity) {
+        capacity *= 2;
+        heap->pages = (unsigned long long *)realloc(
+            heap->pages, capacity * sizeof(unsigned long long));
+      }
+      heap->pages[heap->page_count++] = events[i].ptr + offset;
+    }
+  }
+  qsort(heap->pages, heap->page_count, sizeof(unsigned long long), compare_pages);
+  size_t unique = 0;
+  for (size_t i = 0; i < heap->page_count; i++) {
+    if (unique == 0 || heap->pages[i] != heap->pages[unique - 1]) {
+      heap->pages[unique++] = heap->pages[i];
+    }
+  }
+  heap->page_count = unique;
+  heap->bytes = (unsigned char *)calloc(heap->page_count ? heap->page_count : 1, PAGE_SIZE);
+}
+
+// Return the row of the page that contains |address|, or -1.
+long find_page(const heap_t *heap, unsigned long long address) {
+  unsigned long long page = address - address % PAGE_SIZE;
+  size_t low = 0, high = heap->page_count;
+  while (low < high) {
+    size_t middle = (low + high) / 2;
+    if (heap->pages[middle] < page) {
+      low = middle + 1;
+    } else {
+      high = middle;
+    }
+  }
+  return low < heap->page_count && heap->pages[low] == page ? (long)low : -1;
+}
+
+// Set the state of the bytes [begin, end). Bytes outside the known pages are
+// ignored.
+void mark(heap_t *heap, unsigned long long begin, unsigned long long end, state_t state) {
+  while (begin < end) {
+    unsigned long long page_end = begin - begin % PAGE_SIZE + PAGE_SIZE;
+    unsigned long long chunk_end = end < page_end ? end : page_end;
+    long row = find_page(heap, begin);
+    if (row >= 0) {
+      memset(heap->bytes + row * PAGE_SIZE + begin % PAGE_SIZE, state,
+             chunk_end - begin);
+    }
+    begin = chunk_end;
+  }
+}
+
+// Return the colour of the |bytes_per_pixel| bytes starting at |bytes|.
+state_t classify_pixel(const unsigned char *bytes, int bytes_per_pixel) {
+  int counts[STATE_COUNT] = {0};
+  for (int i = 0; i < bytes_per_pixel; i++) {
+    counts[bytes[i]]++;
+  }
+  if (counts[BYTE_UNMAPPED] == bytes_per_pixel) {
+    return BYTE_UNMAPPED;
+  }
+  int used = counts[BYTE_HEADER] + counts[BYTE_ALLOCATED];
+  if (used == 0) {
+    return BYTE_FREE;
+  }
+  if (used < bytes_per_pixel - counts[BYTE_UNMAPPED]) {
+    return PIXEL_PARTIAL;
+  }
+  return counts[BYTE_HEADER] * 2 >= used ? BYTE_HEADER : BYTE_ALLOCATED;
+}
+
+// Print the number of mapped, empty and sparse pages at |epoch|.
+void print_summary(const heap_t *heap, long long epoch) {
+  size_t mapped = 0, empty = 0, sparse = 0;
+  for (size_t i = 0; i < heap->page_count; i++) {
+    const unsigned char *bytes = heap->bytes + i * PAGE_SIZE;
+    if (bytes[0] == BYTE_UNMAPPED) {
+      continue;
+    }
+    size_t used = 0;
+    for (int j = 0; j < PAGE_SIZE; j++) {
+      used += bytes[j] == BYTE_HEADER || bytes[j] == BYTE_ALLOCATED;
+    }
+    mapped++;
+    empty += used == 0;
+    sparse += used > 0 && used * 4 < PAGE_SIZE;
+  }
+  printf("%8lld | %8zu | %8zu | %8zu\n", epoch, mapped, empty, sparse);
+}
+
+void write_ppm(const heap_t *heap, const char *output, long long epoch, int width) {
+  char file_name[1024];
+  snprintf(file_name, sizeof(file_name), "%s_%04lld.ppm", output, epoch);
+  FILE *fp = fopen(file_name, "wb");
+  if (!fp) {
+    fprintf(stderr, "Failed to open %s\n", file_name);
+    exit(EXIT_FAILURE);
+  }
+  int bytes_per_pixel = PAGE_SIZE / width;
+  fprintf(fp, "P6\n%d %zu\n255\n", width, heap->page_count);
+  for (size_t i = 0; i < heap->page_count; i++) {
+    for (int x = 0; x < width; x++) {
+      state_t state = classify_pixel(heap->bytes + i * PAGE_SIZE + x * bytes_per_pixel,
+                                     bytes_per_pixel);
+      fwrite(state_colors[state], 1, 3, fp);
+    }
+  }
+  fclose(fp);
+}
+
+// Append a frame to the HTML page. Each row is run-length encoded as a
+// state character followed by the run length.
+void write_html_frame(const heap_t *heap, FILE *fp, long long epoch, int width) {
+  int bytes_per_pixel = PAGE_SIZE / width;
+  fprintf(fp, "{epoch: %lld, rows: [\n", epoch);
+  for (size_t i = 0; i < heap->page_count; i++) {
+    fputc('"', fp);
+    state_t run_state = STATE_COUNT;
+    int run_length = 0;
+    for (int x = 0; x <= width; x++) {
+      state_t state = x < width ? classify_pixel(heap->bytes + i * PAGE_SIZE +
+                                                     x * bytes_per_pixel,
+                                                 bytes_per_pixel)
+                                : STATE_COUNT;
+      if (state != run_state && run_length) {
+        fprintf(fp, "%c%d", state_chars[run_state], run_length);
+        run_length = 0;
+      }
+      run_state = state;
+      run_length++;
+    }
+    fputs("\",\n", fp);
+  }
+  fputs("]},\n", fp);
+}
+
+void write_html_header(FILE *fp, const char *trace_file_name, int width,
+                       size_t page_count) {
+  fprintf(fp,
+          "<!DOCTYPE html>\n<html><head><meta charset=\"utf-8\">\n"
+          "<title>Heap layout: %s</title></head>\n<body>\n"
+          "<p>%s: %zu pages, one row per page. <span id=\"label\"></span></p>\n"
+          "<p><input type=\"range\" id=\"epoch\" min=\"0\" value=\"0\" "
+          "style=\"width: %dpx\"></p>\n<p>",
+          trace_file_name, trace_file_name, page_count, width);
+  for (int i = 0; i < STATE_COUNT; i++) {
+    fprintf(fp, "<span style=\"background: #%02x%02x%02x\">&nbsp;&nbsp;</span> %s ",
+            state_colors[i][0], state_colors[i][1], state_colors[i][2], state_names[i]);
+  }
+  fprintf(fp, "</p>\n<canvas id=\"heap\" width=\"%d\" height=\"%zu\"></canvas>\n",
+          width, page_count);
+  fputs("<script>\nconst frames = [\n", fp);
+}
+
+void write_html_footer(FILE *fp) {
+  fputs("];\nconst colors = {", fp);
+  for (int i = 0; i < STATE_COUNT; i++) {
+    fprintf(fp, "%c: \"#%02x%02x%02x\", ", state_chars[i], state_colors[i][0],
+            state_colors[i][1], state_colors[i][2]);
+  }
+  fputs(
+      "};\n"
+      "const canvas = document.getElementById(\"heap\");\n"
+      "const context = canvas.getContext(\"2d\");\n"
+      "const slider = document.getElementById(\"epoch\");\n"
+      "slider.max = frames.length - 1;\n"
+      "function draw(index) {\n"
+      "  const frame = frames[index];\n"
+      "  document.getElementById(\"label\").textContent = \"Epoch \" + frame.epoch;\n"
+      "  frame.rows.forEach((row, y) => {\n"
+      "    let x = 0;\n"
+      "    for (const run of row.matchAll(/([a-z])(\\d+)/g)) {\n"
+      "      context.fillStyle = colors[run[1]];\n"
+      "      context.fillRect(x, y, Number(run[2]), 1);\n"
+      "      x += Number(run[2]);\n"
+      "    }\n"
+      "  });\n"
+      "}\n"
+      "slider.oninput = () => draw(slider.value);\n"
+      "draw(0);\n"
+      "</script>\n</body></html>\n",
+      fp);
+}
+
+int main(int argc, char **argv) {
+  const char *output = NULL;
+  const char *format = "html";
+  int width = 256;
+  int header_size = -1;
+  int first_arg = 1;
+  while (first_arg + 1 < argc && argv[first_arg][0] == '-') {
+    if (strcmp(argv[first_arg], "-o") == 0) {
+      output = argv[first_arg + 1];
+    } else if (strcmp(argv[first_arg], "-f") == 0) {
+      format = argv[first_arg + 1];
+    } else if (strcmp(argv[first_arg], "-w") == 0) {
+      width = atoi(argv[first_arg + 1]);
+    } else if (strcmp(argv[first_arg], "-H") == 0) {
+      header_size = atoi(argv[first_arg + 1]);
+    } else {
+      break;
+    }
+    first_arg += 2;
+  }
+  bool ppm = strcmp(format, "ppm") == 0;
+  if (first_arg + 1 != argc || (!ppm && strcmp(format, "html") != 0) || width <= 0 ||
+      width > PAGE_SIZE || PAGE_SIZE % width != 0) {
+    fprintf(stderr,
+            "Usage: %s [-o output] [-f html|ppm] [-w width] [-H header_size] trace\n"
+            "|width| must divide %d.\n",
+            argv[0], PAGE_SIZE);
+    return EXIT_FAILURE;
+  }
+  const char *trace_file_name = argv[first_arg];
+  if (header_size < 0) {
+    header_size = strstr(trace_file_name, "first_fit") ? 16 : 32;
+  }
+  char default_output[1024];
+  if (!output) {
+    // trace1_best.txt => trace1_best.html / trace1_best_<epoch>.ppm
+    snprintf(default_output, sizeof(default_output), "%s", trace_file_name);
+    char *dot = strrchr(default_output, '.');
+    if (dot) {
+      *dot = '\0';
+    }
+    if (!ppm) {
+      strncat(default_output, ".html", sizeof(default_output) - strlen(default_output) - 1);
+    }
+    output = default_output;
+  }
+
+  size_t event_count;
+  event_t *events = read_trace(trace_file_name, &event_count);
+  heap_t heap;
+  heap_create(&heap, events, event_count);
+
+  FILE *html_fp = NULL;
+  if (!ppm) {
+    html_fp = fopen(output, "w");
+    if (!html_fp) {
+      fprintf(stderr, "Failed to open %s\n", output);
+      return EXIT_FAILURE;
+    }
+    write_html_header(html_fp, trace_file_name, width, heap.page_count);
+  }
+  printf("%8s | %8s | %8s | %8s\n", "Epoch", "Mapped", "Empty", "Sparse");
+  long long last_epoch = -1;
+  bool pending = false;  // Whether there are events after the last frame.
+  for (size_t i = 0; i <= event_count; i++) {
+    // Traces without epoch markers get a single frame at the end.
+    bool end_of_trace = i == event_count;
+    if (end_of_trace ? pending : events[i].type == 'e') {
+      long long epoch = end_of_trace ? last_epoch + 1 : (long long)events[i].ptr;
+      print_summary(&heap, epoch);
+      if (ppm) {
+        write_ppm(&heap, output, epoch, width);
+      } else {
+        write_html_frame(&heap, html_fp, epoch, width);
+      }
+      last_epoch = epoch;
+      pending = false;
+      continue;
+    }
+    if (end_of_trace) {
+      break;
+    }
+    const event_t *event = &events[i];
+    pending = true;
+    switch (event->type) {
+      case 'm':
+        mark(&heap, event->ptr, event->ptr + event->size, BYTE_FREE);
+        break;
+      case 'u':
+        mark(&heap, event->ptr, event->ptr + event->size, BYTE_UNMAPPED);
+        break;
+      case 'a':
+        mark(&heap, event->ptr - header_size, event->ptr, BYTE_HEADER);
+        mark(&heap, event->ptr, event->ptr + event->size, BYTE_ALLOCATED);
+        break;
+      case 'f':
+        mark(&heap, event->ptr - header_size, event->ptr + event->size, BYTE_FREE);
+        break;
+    }
+  }
+  if (html_fp) {
+    write_html_footer(html_fp);
+    fclose(html_fp);
+  }
+  free(heap.pages);
+  free(heap.bytes);
+  free(events);
+  return EXIT_SUCCESS;
+}
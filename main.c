@@ -1,11 +1,23 @@
+#define _GNU_SOURCE  // For sched_setaffinity()
 #include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
 #include <math.h>
+#include <sched.h>
+#include <stdbool.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <signal.h>
 #include <sys/mman.h>
-#include <sys/time.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "best_malloc.h"
+#include "best_malloc_stats.h"
+#include "malloc_hooks.h"
 
 // [First fit malloc]
 void first_fit_initialize();
@@ -19,17 +31,41 @@ void *best_fit_malloc(size_t size);
 void best_fit_free(void *ptr);
 void best_fit_finalize();
 
-// [Best malloc]
-void best_initialize();
-void *best_malloc(size_t size);
-void best_free(void *ptr);
-void best_finalize();
+// [Best malloc] See best_malloc.h.
+
+// [Bump malloc] A reference that never reuses memory.
+void bump_initialize();
+void *bump_malloc(size_t size);
+void bump_free(void *ptr);
+void bump_finalize();
+
+// [Null malloc] A reference that stubs out allocation to measure the harness.
+void null_initialize();
+void *null_malloc(size_t size);
+void null_free(void *ptr);
+void null_finalize();
+
+// [Performance counters]
+#define PERF_COUNTERS 6
+extern const char *perf_counter_names[PERF_COUNTERS];
+void perf_counters_open();
+const char *perf_counters_unavailable_reason();
+void perf_counters_start();
+void perf_counters_stop(long long *counts);
+void perf_counters_pause();
+void perf_counters_resume();
+
+// [Trace ring]
+bool trace_ring_open(const char *target);
+void trace_ring_push(char kind, uint64_t ptr, uint64_t size);
+size_t trace_ring_close();
 
 // Vector
 typedef struct object_t {
   void *ptr;
   size_t size;
   char tag;  // A tag to check the object is not broken.
+  unsigned sequence;  // The allocation order in the challenge.
 } object_t;
 
 typedef struct vector_t {
@@ -75,11 +111,12 @@ void vector_destroy(vector_t *vector) {
   free(vector);
 }
 
-// Return the current time in seconds.
+// Return the current time in seconds. The clock is monotonic so that
+// intervals are not disturbed by adjustments of the wall clock.
 double get_time(void) {
-  struct timeval tv;
-  gettimeofday(&tv, NULL);
-  return tv.tv_sec + tv.tv_usec * 1e-6;
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec * 1e-9;
 }
 
 // Return a random number in [0, 1).
@@ -126,108 +163,597 @@ typedef void *(*malloc_func_t)(size_t size);
 typedef void (*free_func_t)(void *ptr);
 typedef void (*finalize_func_t)();
 
+// Describe the object sizes of a challenge. A challenge consists of one or
+// more phases. The cycles are split evenly between the phases and each phase
+// draws object sizes from its own [min_size, max_size] range, which lets us
+// see how an allocator adapts when the workload changes.
+//
+// With |synthetic_sites|, every object is allocated from one of the
+// synthetic allocation sites below, whose lifetime decides the site.
+//
+// |scale| multiplies the number of objects per epoch, and with it the live
+// set.
+//
+// A soak challenge (see run_soak()) has a nonzero |operation_limit|: it
+// repeats the cycles until that many mallocs and frees, or forever if the
+// limit is negative, and frees every object so that the live set stays
+// steady. |cycle_func| is called at the end of each cycle, outside the
+// timed region.
+//
+// With |locality|, the live objects are walked in allocation order after
+// each epoch (see walk_live_objects()).
+//
+// |cache_mode| sets the state of the caches when the timed region starts.
+#define MAX_PHASES 4
+// Malloc latencies are counted in buckets of a quarter of a power of two
+// nanoseconds, up to about 4 seconds, to read percentiles from.
+#define LATENCY_BUCKETS 128
+
+typedef enum cache_mode_t {
+  AS_IS_CACHE,  // Whatever the work before left behind.
+  WARM_CACHE,   // On the heap of a discarded pass over the same challenge.
+  COLD_CACHE,   // After evict_caches().
+} cache_mode_t;
+
+typedef struct challenge_t {
+  int phase_count;
+  size_t min_size[MAX_PHASES];
+  size_t max_size[MAX_PHASES];
+  bool synthetic_sites;
+  int scale;
+  long long operation_limit;
+  void (*cycle_func)(void);
+  bool locality;
+  // Whether to measure the page spread (see stats_t). That walks every live
+  // object at the end of each epoch and so evicts the allocator's working set
+  // from the caches, which would perturb the timing of the scored runs. The
+  // trace build always measures it.
+  bool measure_page_spread;
+  cache_mode_t cache_mode;
+  // Whether to time each malloc on its own (see stats_t).
+  bool measure_latency;
+  // Called at the end of each epoch, or NULL. It is part of the time of the
+  // run but timed on its own (see stats_t), not as malloc or free.
+  void (*epoch_func)(void);
+  // Set on the discarded pass of a WARM_CACHE run and on the run after it
+  // respectively. The pass frees all its objects at the end and leaves the
+  // heap mapped instead of finalizing it, and the run continues on that heap
+  // instead of initializing a new one.
+  bool keep_heap;
+  bool reuse_heap;
+} challenge_t;
+
+// An object to allocate, drawn before the mallocs of its epoch.
+typedef struct request_t {
+  size_t size;
+  int lifetime;
+  int site;  // A site_t
+  bool never_freed;
+  void *ptr;
+} request_t;
+
+// Epoch 0 of each cycle allocates a peak of objects, the others a steady
+// trickle.
+typedef enum epoch_type_t {
+  PEAK_EPOCH,
+  STEADY_EPOCH,
+  EPOCH_TYPES,
+} epoch_type_t;
+
 // Record the statistics of each challenge.
 typedef struct stats_t {
   double begin_time;
   double end_time;
+  // The time between begin_time and end_time that is not part of the run:
+  // the measurements of the live set and the |cycle_func| of the challenge.
+  double paused_time;
   size_t mmap_size;
   size_t munmap_size;
   size_t allocated_size;
   size_t freed_size;
+  // The number of mallocs and frees.
+  size_t operation_count;
+  // The time in seconds spent in malloc, in free and in the harness (drawing
+  // requests, writing and checking tags) by epoch type.
+  double malloc_time[EPOCH_TYPES];
+  double free_time[EPOCH_TYPES];
+  double harness_time[EPOCH_TYPES];
+  // The hardware counters over the timed region, or -1 if unavailable.
+  long long perf_counts[PERF_COUNTERS];
+  // The most bytes mapped and live at any time.
+  size_t peak_mapped_size;
+  size_t peak_live_size;
+  // Whether a malloc returned NULL, which ends the run (see memory_budget).
+  bool out_of_memory;
+  // The slowest malloc, the histogram of malloc latencies and the number of
+  // mallocs that mapped memory from the system, if the challenge measures
+  // latency. The first cycle is a warm-up and not measured.
+  double max_malloc_latency;
+  size_t latency_histogram[LATENCY_BUCKETS];
+  size_t mapping_malloc_count;
+  // The time spent in the |epoch_func| of the challenge.
+  double epoch_func_time;
+  // The walks over the live objects of a |locality| challenge, summed over
+  // the epochs: the time, the objects and bytes walked and the distinct
+  // cache lines and pages they touched.
+  double walk_time;
+  size_t walk_object_count;
+  size_t walk_size;
+  size_t walk_line_count;
+  size_t walk_page_count;
+  // The page spread at the end of each epoch: the distinct 4 KiB pages that
+  // hold live objects over live bytes / 4096. 1 means the live set is packed
+  // into as few pages as it can be. Summed over the epochs, and the max.
+  double page_spread_sum;
+  double peak_page_spread;
+  size_t epoch_count;
+  // Snapshots taken at the end of each phase. |phase_end_time| leaves out the
+  // paused time so far, as the time of the run does.
+  double phase_end_time[MAX_PHASES];
+  size_t phase_mapped_size[MAX_PHASES];
+  size_t phase_live_size[MAX_PHASES];
 } stats_t;
 
 stats_t stats;
-FILE *trace_fp;
+bool tracing;
+// mmap_from_system() fails once more than this many bytes would be mapped,
+// or never if 0.
+size_t memory_budget;
+best_stats_page_t *stats_page;  // NULL unless BEST_MALLOC_STATS is set.
+
+// Return a challenge that allocates objects in [min_size, max_size]
+// throughout.
+challenge_t single_phase_challenge(size_t min_size, size_t max_size) {
+  challenge_t challenge = {1, {min_size}, {max_size}, false, 1};
+  return challenge;
+}
+
+// Synthetic allocation sites. Allocators that key on the caller's return
+// address see each of them as a distinct site:
+//   *  Short-lived: freed in the next epoch.
+//   *  Medium-lived: the usual exponential lifetime within a cycle.
+//   *  Long-lived: never freed.
+// The empty asm statements keep the calls from becoming tail calls, which
+// would hide the sites.
+typedef enum site_t {
+  SHORT_LIVED_SITE,
+  MEDIUM_LIVED_SITE,
+  LONG_LIVED_SITE,
+} site_t;
+
+__attribute__((noinline)) void *malloc_at_short_lived_site(malloc_func_t malloc_func,
+                                                           size_t size) {
+  void *ptr = malloc_func(size);
+  __asm__ volatile("" ::: "memory");
+  return ptr;
+}
+
+__attribute__((noinline)) void *malloc_at_medium_lived_site(malloc_func_t malloc_func,
+                                                            size_t size) {
+  void *ptr = malloc_func(size);
+  __asm__ volatile("" ::: "memory");
+  return ptr;
+}
+
+__attribute__((noinline)) void *malloc_at_long_lived_site(malloc_func_t malloc_func,
+                                                          size_t size) {
+  void *ptr = malloc_func(size);
+  __asm__ volatile("" ::: "memory");
+  return ptr;
+}
+
+// Pick a site: 60% short-lived, 30% medium-lived and 10% long-lived.
+site_t get_object_site() {
+  double r = urand();
+  return r < 0.6 ? SHORT_LIVED_SITE : r < 0.9 ? MEDIUM_LIVED_SITE : LONG_LIVED_SITE;
+}
+
+// The trace writer, attached to the allocator under test through its hooks.
+// A trace has one event per line: "a <ptr> <size>" for malloc, "f <ptr>
+// <size>" for free, both with the requested size, "m <ptr> <size>" /
+// "u <ptr> <size>" for mapping / unmapping a region, and "e <epoch>" at the
+// end of each epoch. The hooks only push the events to the trace ring; its
+// drain thread formats and writes them. The "f" events are pushed by
+// run_challenge(), which knows the requested size, rather than by on_free,
+// which reports the allocator's usable size.
+void trace_malloc(void *ptr, size_t size) {
+  trace_ring_push('a', (uintptr_t)ptr, size);
+}
+
+void trace_map(void *ptr, size_t size) {
+  trace_ring_push('m', (uintptr_t)ptr, size);
+}
+
+void trace_unmap(void *ptr, size_t size) {
+  trace_ring_push('u', (uintptr_t)ptr, size);
+}
+
+const malloc_hooks_t trace_hooks = {trace_malloc, NULL, trace_map, trace_unmap};
+
+int compare_objects_by_sequence(const void *a, const void *b) {
+  unsigned x = ((const object_t *)a)->sequence;
+  unsigned y = ((const object_t *)b)->sequence;
+  return x < y ? -1 : x > y;
+}
+
+int compare_objects_by_address(const void *a, const void *b) {
+  uintptr_t x = (uintptr_t)((const object_t *)a)->ptr;
+  uintptr_t y = (uintptr_t)((const object_t *)b)->ptr;
+  return x < y ? -1 : x > y;
+}
+
+// Return the number of distinct |unit|-byte blocks that |objects|, sorted
+// by address, touch.
+size_t count_touched_blocks(const object_t *objects, size_t count, size_t unit) {
+  size_t blocks = 0;
+  uintptr_t last = UINTPTR_MAX;
+  for (size_t i = 0; i < count; i++) {
+    uintptr_t first = (uintptr_t)objects[i].ptr / unit;
+    uintptr_t end = ((uintptr_t)objects[i].ptr + objects[i].size - 1) / unit;
+    if (first == last) {
+      first++;
+    }
+    if (first <= end) {
+      blocks += end - first + 1;
+    }
+    last = end;
+  }
+  return blocks;
+}
+
+volatile uint64_t walk_sink;
+
+// Evict the caches and the TLBs by streaming over a buffer much larger than
+// the last-level cache, with a write and a read per cache line, so that the
+// timed region starts as a request handler would after a context switch.
+#define EVICTION_BUFFER_SIZE (128 * 1024 * 1024)
+
+char *eviction_buffer;
+
+void evict_caches() {
+  if (!eviction_buffer) {
+    eviction_buffer = (char *)mmap(NULL, EVICTION_BUFFER_SIZE, PROT_READ | PROT_WRITE,
+                                   MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    assert(eviction_buffer != MAP_FAILED);
+  }
+  for (size_t i = 0; i < EVICTION_BUFFER_SIZE; i += 64) {
+    eviction_buffer[i] = (char)i;
+  }
+  uint64_t sum = 0;
+  for (size_t i = 0; i < EVICTION_BUFFER_SIZE; i += 64) {
+    sum += eviction_buffer[i];
+  }
+  walk_sink += sum;
+}
+
+// A hash set of page numbers, to count the distinct pages that hold live
+// objects without sorting them.
+typedef struct page_set_t {
+  uintptr_t *slots;  // The page number + 1, or 0 if the slot is empty.
+  size_t capacity;   // A power of two.
+  size_t count;
+} page_set_t;
+
+// Empty |set| and make room for up to |max_count| pages.
+void page_set_reset(page_set_t *set, size_t max_count) {
+  if (set->capacity < max_count * 2) {
+    while (set->capacity < max_count * 2) {
+      set->capacity = set->capacity ? set->capacity * 2 : 1024;
+    }
+    free(set->slots);
+    set->slots = (uintptr_t *)malloc(set->capacity * sizeof(uintptr_t));
+  }
+  memset(set->slots, 0, set->capacity * sizeof(uintptr_t));
+  set->count = 0;
+}
+
+void page_set_add(page_set_t *set, uintptr_t page) {
+  size_t index = (page * 0x9e3779b97f4a7c15ULL) & (set->capacity - 1);
+  while (set->slots[index] && set->slots[index] != page + 1) {
+    index = (index + 1) & (set->capacity - 1);
+  }
+  if (!set->slots[index]) {
+    set->slots[index] = page + 1;
+    set->count++;
+  }
+}
+
+// Add the page spread of the live objects to |stats|. Objects are at most
+// 4000 bytes, so each one spans at most two pages.
+void record_page_spread(vector_t **objects, int vector_count, page_set_t *pages) {
+  size_t count = 0;
+  for (int i = 0; i < vector_count; i++) {
+    count += vector_size(objects[i]);
+  }
+  page_set_reset(pages, count * 2);
+  size_t live_size = 0;
+  for (int i = 0; i < vector_count; i++) {
+    for (size_t j = 0; j < vector_size(objects[i]); j++) {
+      object_t object = vector_at(objects[i], j);
+      page_set_add(pages, (uintptr_t)object.ptr / 4096);
+      page_set_add(pages, ((uintptr_t)object.ptr + object.size - 1) / 4096);
+      live_size += object.size;
+    }
+  }
+  if (!live_size) {
+    return;
+  }
+  double spread = pages->count / ((double)live_size / 4096);
+  stats.page_spread_sum += spread;
+  stats.epoch_count++;
+  if (spread > stats.peak_page_spread) {
+    stats.peak_page_spread = spread;
+  }
+}
+
+// Read every live object in allocation order, as an application walking a
+// list of what it allocated would, and add the time and the distinct cache
+// lines and pages touched to |stats|. Objects allocated together cost few
+// lines and pages if the allocator placed them together. Only the reads are
+// timed.
+void walk_live_objects(vector_t **objects, int vector_count) {
+  size_t count = 0;
+  for (int i = 0; i < vector_count; i++) {
+    count += vector_size(objects[i]);
+  }
+  if (!count) {
+    return;
+  }
+  object_t *live = (object_t *)malloc(count * sizeof(object_t));
+  size_t live_count = 0;
+  for (int i = 0; i < vector_count; i++) {
+    for (size_t j = 0; j < vector_size(objects[i]); j++) {
+      live[live_count++] = vector_at(objects[i], j);
+    }
+  }
+  qsort(live, count, sizeof(object_t), compare_objects_by_sequence);
+
+  double begin_time = get_time();
+  uint64_t sum = 0;
+  for (size_t i = 0; i < count; i++) {
+    const uint64_t *words = (const uint64_t *)live[i].ptr;
+    for (size_t j = 0; j < live[i].size / sizeof(uint64_t); j++) {
+      sum += words[j];
+    }
+  }
+  stats.walk_time += get_time() - begin_time;
+  walk_sink += sum;
+
+  qsort(live, count, sizeof(object_t), compare_objects_by_address);
+  stats.walk_object_count += count;
+  for (size_t i = 0; i < count; i++) {
+    stats.walk_size += live[i].size;
+  }
+  stats.walk_line_count += count_touched_blocks(live, count, 64);
+  stats.walk_page_count += count_touched_blocks(live, count, 4096);
+  free(live);
+}
+
+// Leave the time until resume_run() out of the time and the performance
+// counters of the run. Return the time to pass to resume_run().
+double pause_run() {
+  perf_counters_pause();
+  return get_time();
+}
+
+void resume_run(double pause_begin_time) {
+  stats.paused_time += get_time() - pause_begin_time;
+  perf_counters_resume();
+}
 
 // Run one challenge.
-// |min_size|: The min size of an allocated object
-// |max_size|: The max size of an allocated object
+// |challenge|: The size ranges of allocated objects
 // |*_func|: Function pointers to initialize / malloc / free.
-void run_challenge(const char *trace_file_name, size_t min_size,
-                   size_t max_size, initialize_func_t initialize_func,
+void run_challenge(const char *trace_file_name, const challenge_t *challenge,
+                   initialize_func_t initialize_func,
                    malloc_func_t malloc_func, free_func_t free_func,
                    finalize_func_t finalize_func) {
-  trace_fp = NULL;
+  tracing = false;
 #ifdef ENABLE_MALLOC_TRACE
   if (trace_file_name) {
-    trace_fp = fopen(trace_file_name, "wb");
-    if (!trace_fp) {
-      fprintf(stderr, "Failed to open a trace file: %s\n", trace_file_name);
+    // MALLOC_TRACE_TARGET sends the events to a pipe or a socket instead,
+    // e.g. "unix:/tmp/analyzer.sock", for an analyzer that reads them live.
+    // Each traced run opens it once: the analyzer accepts a connection, or
+    // reopens the pipe after the end of file, per run.
+    const char *target = getenv("MALLOC_TRACE_TARGET");
+    if (!target) {
+      target = trace_file_name;
+    }
+    if (!trace_ring_open(target)) {
+      fprintf(stderr, "Failed to open a trace target: %s\n", target);
       exit(EXIT_FAILURE);
     }
+    tracing = true;
+    set_malloc_hooks(&trace_hooks);
   }
   const int epochs_per_cycle = 10;
   const int objects_per_epoch_small = 25;
   const int objects_per_epoch_large = 50;
+  const bool measure_page_spread = true;
 #else
   const int epochs_per_cycle = 100;
   const int objects_per_epoch_small = 100;
   const int objects_per_epoch_large = 2000;
+  const bool measure_page_spread = challenge->measure_page_spread;
 #endif
   const int cycles = 10;
+  const bool soak = challenge->operation_limit != 0;
+  bool done = false;
   char tag = 0;
   // The last entry of the vector is used to store objects that are never freed.
   vector_t *objects[epochs_per_cycle + 1];
   for (int i = 0; i < epochs_per_cycle + 1; i++) {
     objects[i] = vector_create();
   }
-  initialize_func();
-  stats.mmap_size = stats.munmap_size = 0;
+  request_t *requests =
+      (request_t *)malloc(objects_per_epoch_large * challenge->scale * sizeof(request_t));
+  for (int i = 0; i < EPOCH_TYPES; i++) {
+    stats.malloc_time[i] = stats.free_time[i] = stats.harness_time[i] = 0;
+  }
   stats.allocated_size = stats.freed_size = 0;
+  stats.operation_count = 0;
+  stats.peak_live_size = 0;
+  if (challenge->reuse_heap) {
+    // The heap is empty but keeps what the pass before mapped, which counts.
+    stats.mmap_size -= stats.munmap_size;
+    stats.munmap_size = 0;
+    stats.peak_mapped_size = stats.mmap_size;
+  } else {
+    stats.mmap_size = stats.munmap_size = 0;
+    stats.peak_mapped_size = 0;
+    // After the reset, so that memory the allocator maps up front counts.
+    initialize_func();
+  }
+  stats.out_of_memory = false;
+  stats.max_malloc_latency = 0;
+  memset(stats.latency_histogram, 0, sizeof(stats.latency_histogram));
+  stats.mapping_malloc_count = 0;
+  stats.epoch_func_time = 0;
+  stats.walk_time = 0;
+  stats.walk_object_count = stats.walk_size = 0;
+  stats.walk_line_count = stats.walk_page_count = 0;
+  stats.page_spread_sum = stats.peak_page_spread = 0;
+  stats.epoch_count = 0;
+  page_set_t pages = {NULL, 0, 0};
+  unsigned sequence = 0;
+  if (challenge->cache_mode == COLD_CACHE) {
+    evict_caches();
+  }
+  stats.paused_time = 0;
   stats.begin_time = get_time();
-  for (int cycle = 0; cycle < cycles; cycle++) {
-    for (int epoch = 0; epoch < epochs_per_cycle; epoch++) {
+  perf_counters_start();
+  for (int cycle = 0; !done && (soak || cycle < cycles); cycle++) {
+    int phase = soak ? 0 : cycle * challenge->phase_count / cycles;
+    size_t min_size = challenge->min_size[phase];
+    size_t max_size = challenge->max_size[phase];
+    for (int epoch = 0; !done && epoch < epochs_per_cycle; epoch++) {
       size_t allocated = 0;
       size_t freed = 0;
 
       // Allocate |objects_per_epoch| objects.
-      int objects_per_epoch = objects_per_epoch_small;
+      int objects_per_epoch = objects_per_epoch_small * challenge->scale;
       if (epoch == 0) {
         // To simulate a peak memory usage, we allocate a larger number of
         // objects from time to time.
-        objects_per_epoch = objects_per_epoch_large;
+        objects_per_epoch = objects_per_epoch_large * challenge->scale;
+      }
+      epoch_type_t epoch_type = epoch == 0 ? PEAK_EPOCH : STEADY_EPOCH;
+      // The requests are drawn up front so that the mallocs, the frees and
+      // the harness work can be timed separately. The random numbers are
+      // drawn in the same order as when they were interleaved with mallocs.
+      double draw_begin_time = get_time();
+      for (int i = 0; i < objects_per_epoch; i++) {
+        request_t *request = &requests[i];
+        request->size = get_object_size(min_size, max_size);
+        request->lifetime = get_object_lifetime(1, epochs_per_cycle);
+        request->site = MEDIUM_LIVED_SITE;
+        request->never_freed = false;
+        if (challenge->synthetic_sites) {
+          request->site = get_object_site();
+        } else if (!soak) {
+          // 4% of objects are set as never freed.
+          request->never_freed = urand() < 0.04;
+        }
       }
+      double malloc_begin_time = get_time();
       for (int i = 0; i < objects_per_epoch; i++) {
-        size_t size = get_object_size(min_size, max_size);
-        int lifetime = get_object_lifetime(1, epochs_per_cycle);
+        request_t *request = &requests[i];
+        if (request->site == SHORT_LIVED_SITE) {
+          request->ptr = malloc_at_short_lived_site(malloc_func, request->size);
+        } else if (request->site == LONG_LIVED_SITE) {
+          request->ptr = malloc_at_long_lived_site(malloc_func, request->size);
+        } else if (challenge->synthetic_sites) {
+          request->ptr = malloc_at_medium_lived_site(malloc_func, request->size);
+        } else if (challenge->measure_latency && cycle > 0) {
+          size_t mmap_size = stats.mmap_size;
+          double call_begin_time = get_time();
+          request->ptr = malloc_func(request->size);
+          double latency = get_time() - call_begin_time;
+          if (latency > stats.max_malloc_latency) {
+            stats.max_malloc_latency = latency;
+          }
+          int bucket = latency > 1e-9 ? (int)(log2(latency * 1e9) * 4) : 0;
+          stats.latency_histogram[bucket < LATENCY_BUCKETS ? bucket : LATENCY_BUCKETS - 1]++;
+          if (stats.mmap_size != mmap_size) {
+            stats.mapping_malloc_count++;
+          }
+        } else {
+          request->ptr = malloc_func(request->size);
+        }
+        if (!request->ptr) {
+          // Out of memory budget. Keep the objects so far and end the run.
+          stats.out_of_memory = true;
+          objects_per_epoch = i;
+          done = true;
+          break;
+        }
+      }
+      double malloc_end_time = get_time();
+      for (int i = 0; i < objects_per_epoch; i++) {
+        size_t size = requests[i].size;
+        int lifetime = requests[i].lifetime;
+        site_t site = requests[i].site;
+        void *ptr = requests[i].ptr;
         stats.allocated_size += size;
+        stats.operation_count++;
         allocated += size;
-        void *ptr = malloc_func(size);
-        if (trace_fp) {
-          fprintf(trace_fp, "a %llu %ld\n", (unsigned long long)ptr, size);
-        }
         memset(ptr, tag, size);
-        object_t object = {ptr, size, tag};
+        object_t object = {ptr, size, tag, sequence++};
         tag++;
         if (tag == 0) {
           // Avoid 0 for tagging since it is not distinguishable from fresh
           // mmaped memory.
           tag++;
         }
-        if (urand() < 0.04) {
-          // 4% of objects are set as never freed.
+        if (challenge->synthetic_sites) {
+          if (site == SHORT_LIVED_SITE) {
+            vector_push(objects[(epoch + 1) % epochs_per_cycle], object);
+          } else if (site == MEDIUM_LIVED_SITE) {
+            vector_push(objects[(epoch + lifetime) % epochs_per_cycle], object);
+          } else {
+            vector_push(objects[epochs_per_cycle], object);
+          }
+        } else if (requests[i].never_freed) {
           vector_push(objects[epochs_per_cycle], object);
         } else {
           vector_push(objects[(epoch + lifetime) % epochs_per_cycle], object);
         }
       }
+      if (stats.allocated_size - stats.freed_size > stats.peak_live_size) {
+        stats.peak_live_size = stats.allocated_size - stats.freed_size;
+      }
       // Free objects that are expected to be freed in this epoch.
       vector_t *vector = objects[epoch];
       for (size_t i = 0; i < vector_size(vector); i++) {
         object_t object = vector_at(vector, i);
         stats.freed_size += object.size;
+        stats.operation_count++;
         freed += object.size;
         // Check that the tag is not broken.
         if (((char *)object.ptr)[0] != object.tag ||
             ((char *)object.ptr)[object.size - 1] != object.tag) {
           assert(0);
         }
-        if (trace_fp) {
-          fprintf(trace_fp, "f %llu %ld\n", (unsigned long long)object.ptr,
-                  object.size);
+      }
+      double free_begin_time = get_time();
+      for (size_t i = 0; i < vector_size(vector); i++) {
+#ifdef ENABLE_MALLOC_TRACE
+        if (tracing) {
+          object_t object = vector_at(vector, i);
+          trace_ring_push('f', (uintptr_t)object.ptr, object.size);
         }
-        free_func(object.ptr);
+#endif
+        free_func(vector_at(vector, i).ptr);
       }
+      double free_end_time = get_time();
+      if (challenge->epoch_func) {
+        challenge->epoch_func();
+        stats.epoch_func_time += get_time() - free_end_time;
+      }
+      stats.malloc_time[epoch_type] += malloc_end_time - malloc_begin_time;
+      stats.free_time[epoch_type] += free_end_time - free_begin_time;
+      stats.harness_time[epoch_type] += (malloc_begin_time - draw_begin_time) +
+                                        (free_begin_time - malloc_end_time);
 
 #if 0
       // Debug print
@@ -242,80 +768,600 @@ void run_challenge(const char *trace_file_name, size_t min_size,
                    / (stats.mmap_size - stats.munmap_size)));
 #endif
       vector_clear(vector);
+      // The measurements of the live set are not part of the run.
+      if (measure_page_spread || challenge->locality) {
+        double measure_begin_time = pause_run();
+        if (measure_page_spread) {
+          record_page_spread(objects, epochs_per_cycle + 1, &pages);
+        }
+        if (challenge->locality) {
+          walk_live_objects(objects, epochs_per_cycle + 1);
+        }
+        resume_run(measure_begin_time);
+      }
+      if (stats_page && malloc_func == best_malloc) {
+        // best_malloc does not write its statistics page from malloc or free,
+        // so refresh it between epochs, outside the run.
+        double publish_begin_time = pause_run();
+        best_publish_stats();
+        resume_run(publish_begin_time);
+      }
+      if (tracing) {
+        trace_ring_push('e', cycle * epochs_per_cycle + epoch, 0);
+      }
+      if (challenge->operation_limit > 0 &&
+          stats.operation_count >= (size_t)challenge->operation_limit) {
+        done = true;
+      }
       // printf("cycle done %d\n", cycle);
     }
+    if (challenge->cycle_func) {
+      // Leave the callback out of the run.
+      double pause_begin_time = pause_run();
+      challenge->cycle_func();
+      resume_run(pause_begin_time);
+    }
+    if (!soak && (cycle + 1) * challenge->phase_count / cycles != phase) {
+      stats.phase_end_time[phase] = get_time() - stats.paused_time;
+      stats.phase_mapped_size[phase] = stats.mmap_size - stats.munmap_size;
+      stats.phase_live_size[phase] = stats.allocated_size - stats.freed_size;
+    }
   }
+  perf_counters_stop(stats.perf_counts);
   stats.end_time = get_time();
   for (int i = 0; i < epochs_per_cycle + 1; i++) {
+    if (challenge->keep_heap) {
+      for (size_t j = 0; j < vector_size(objects[i]); j++) {
+        free_func(vector_at(objects[i], j).ptr);
+      }
+    }
     vector_destroy(objects[i]);
   }
-  finalize_func();
-  if (trace_fp) {
-    fclose(trace_fp);
-    trace_fp = NULL;
+  free(requests);
+  free(pages.slots);
+  if (!challenge->keep_heap) {
+    // Memory the allocator returns when it is torn down does not count toward
+    // the utilization of the run.
+    size_t munmap_size = stats.munmap_size;
+    finalize_func();
+    stats.munmap_size = munmap_size;
+  }
+#ifdef ENABLE_MALLOC_TRACE
+  if (trace_file_name) {
+    set_malloc_hooks(NULL);
+    size_t dropped_count = trace_ring_close();
+    if (dropped_count) {
+      fprintf(stderr, "%s: dropped %zu trace events\n", trace_file_name, dropped_count);
+    }
+    tracing = false;
   }
+#endif
 }
 
 #define FIRST_CHALLENGE_INDEX 1
 #define LAST_CHALLENGE_INDEX 5
 
+// The [min_size, max_size] of each scored challenge.
+const size_t challenge_sizes[LAST_CHALLENGE_INDEX + 1][2] = {
+    {0, 0}, {128, 128}, {16, 16}, {16, 128}, {256, 4000}, {8, 4000}};
+
 int best_malloc_time_ms[LAST_CHALLENGE_INDEX + 1];
 int best_malloc_utilization_percentage[LAST_CHALLENGE_INDEX + 1];
 
-// Print stats
-void print_stats(int challenge_index, stats_t first_fit_stats, stats_t best_fit_stats,
-                 stats_t best_stats) {
-  assert(FIRST_CHALLENGE_INDEX <= challenge_index &&
-         challenge_index <= LAST_CHALLENGE_INDEX);
+// Return the time a challenge took in milliseconds.
+int get_time_ms(const stats_t *stats) {
+  return (stats->end_time - stats->begin_time - stats->paused_time) * 1000;
+}
+
+// Return the malloc latency in seconds that |fraction| of the measured mallocs
+// did not exceed, rounded up to the end of its histogram bucket.
+double get_latency_percentile(const stats_t *stats, double fraction) {
+  size_t count = 0;
+  for (int i = 0; i < LATENCY_BUCKETS; i++) {
+    count += stats->latency_histogram[i];
+  }
+  size_t rank = (size_t)ceil(count * fraction);
+  size_t seen = 0;
+  for (int i = 0; i < LATENCY_BUCKETS && count; i++) {
+    seen += stats->latency_histogram[i];
+    if (seen >= rank) {
+      double latency = exp2((i + 1) / 4.0) * 1e-9;
+      return latency < stats->max_malloc_latency ? latency : stats->max_malloc_latency;
+    }
+  }
+  return 0;
+}
+
+// Return the live bytes at the end of a challenge over the mapped bytes.
+int get_utilization_percentage(const stats_t *stats) {
+  return (int)(100.0 * (stats->allocated_size - stats->freed_size) /
+               (stats->mmap_size - stats->munmap_size));
+}
+
+// Print the time and utilization of the three allocators under |title|.
+void print_stats_table(const char *title, stats_t first_fit_stats,
+                       stats_t best_fit_stats, stats_t best_stats) {
   printf("==========================================================================\n");
-  printf("Challenge #%d    | %16s => %16s => %16s\n", challenge_index, "first_fit_malloc",
+  printf("%-16s| %16s => %16s => %16s\n", title, "first_fit_malloc",
          "best_fit_malloc", "best_malloc");
   printf("%-16s+ %16s => %16s => %16s\n", "---------------", "----------------",
          "----------------", "----------------");
-  int first_fit_time_ms = (first_fit_stats.end_time - first_fit_stats.begin_time) * 1000;
-  int best_fit_time_ms = (best_fit_stats.end_time - best_fit_stats.begin_time) * 1000;
-  int best_time_ms = (best_stats.end_time - best_stats.begin_time) * 1000;
-  int first_fit_utilization_percentage =
-      (int)(100.0 * (first_fit_stats.allocated_size - first_fit_stats.freed_size) /
-            (first_fit_stats.mmap_size - first_fit_stats.munmap_size));
-  int best_fit_utilization_percentage =
-      (int)(100.0 * (best_fit_stats.allocated_size - best_fit_stats.freed_size) /
-            (best_fit_stats.mmap_size - best_fit_stats.munmap_size));
-  int best_utilization_percentage =
-      (int)(100.0 * (best_stats.allocated_size - best_stats.freed_size) /
-            (best_stats.mmap_size - best_stats.munmap_size));
+  int first_fit_time_ms = get_time_ms(&first_fit_stats);
+  int best_fit_time_ms = get_time_ms(&best_fit_stats);
+  int best_time_ms = get_time_ms(&best_stats);
+  int first_fit_utilization_percentage = get_utilization_percentage(&first_fit_stats);
+  int best_fit_utilization_percentage = get_utilization_percentage(&best_fit_stats);
+  int best_utilization_percentage = get_utilization_percentage(&best_stats);
 
   printf("%16s| %16d => %16d => %16d\n", "Time [ms]", first_fit_time_ms, best_fit_time_ms,
          best_time_ms);
   printf("%16s| %16d => %16d => %16d\n", "Utilization [%] ",
          first_fit_utilization_percentage, best_fit_utilization_percentage,
          best_utilization_percentage);
+  // Only measured by the trace build and the site challenges.
+  if (best_stats.epoch_count) {
+    printf("%16s| %16.2f => %16.2f => %16.2f\n", "Page spread",
+           first_fit_stats.page_spread_sum / first_fit_stats.epoch_count,
+           best_fit_stats.page_spread_sum / best_fit_stats.epoch_count,
+           best_stats.page_spread_sum / best_stats.epoch_count);
+    printf("%16s| %16.2f => %16.2f => %16.2f\n", "Page spread max",
+           first_fit_stats.peak_page_spread, best_fit_stats.peak_page_spread,
+           best_stats.peak_page_spread);
+  }
+
+  // The breakdown of the time by loop and by epoch type.
+  stats_t *all_stats[] = {&first_fit_stats, &best_fit_stats, &best_stats};
+  printf("%16s|\n", "Breakdown [ms]");
+  const char *epoch_type_names[EPOCH_TYPES] = {"peak", "steady"};
+  for (int type = 0; type < EPOCH_TYPES; type++) {
+    char label[32];
+    double times[3];
+    for (int i = 0; i < 3; i++) {
+      times[i] = all_stats[i]->malloc_time[type] * 1000;
+    }
+    snprintf(label, sizeof(label), "Malloc %s", epoch_type_names[type]);
+    printf("%16s| %16.1f => %16.1f => %16.1f\n", label, times[0], times[1], times[2]);
+    for (int i = 0; i < 3; i++) {
+      times[i] = all_stats[i]->free_time[type] * 1000;
+    }
+    snprintf(label, sizeof(label), "Free %s", epoch_type_names[type]);
+    printf("%16s| %16.1f => %16.1f => %16.1f\n", label, times[0], times[1], times[2]);
+    for (int i = 0; i < 3; i++) {
+      times[i] = all_stats[i]->harness_time[type] * 1000;
+    }
+    snprintf(label, sizeof(label), "Harness %s", epoch_type_names[type]);
+    printf("%16s| %16.1f => %16.1f => %16.1f\n", label, times[0], times[1], times[2]);
+  }
+}
+
+// Return the time in milliseconds spent in the malloc and free loops of a
+// challenge, without the harness work between them.
+double get_allocation_time_ms(const stats_t *stats) {
+  double time = 0;
+  for (int type = 0; type < EPOCH_TYPES; type++) {
+    time += stats->malloc_time[type] + stats->free_time[type];
+  }
+  return time * 1000;
+}
+
+// Print stats. |null_stats| is the run with allocation stubbed out, whose
+// whole time is the overhead of the harness itself, and whose malloc and
+// free loops are the overhead of calling an allocator at all. That is
+// subtracted from each allocator's loops to give the time spent in it.
+// |bump_stats| is the run with an allocator that never reuses memory, shown
+// as a reference for the fastest an allocator can be. Its free does nothing,
+// so it can come out slightly below null_malloc, which recycles objects.
+void print_stats(int challenge_index, stats_t null_stats, stats_t bump_stats,
+                 stats_t first_fit_stats, stats_t best_fit_stats, stats_t best_stats) {
+  assert(FIRST_CHALLENGE_INDEX <= challenge_index &&
+         challenge_index <= LAST_CHALLENGE_INDEX);
+  char title[16];
+  snprintf(title, sizeof(title), "Challenge #%d", challenge_index);
+  print_stats_table(title, first_fit_stats, best_fit_stats, best_stats);
+  double call_time_ms = get_allocation_time_ms(&null_stats);
+  printf("%16s| %16.1f => %16.1f => %16.1f\n", "Alloc-only [ms]",
+         get_allocation_time_ms(&first_fit_stats) - call_time_ms,
+         get_allocation_time_ms(&best_fit_stats) - call_time_ms,
+         get_allocation_time_ms(&best_stats) - call_time_ms);
+  printf("%16s| harness %d ms (calls %.1f ms)\n", "Baseline ", get_time_ms(&null_stats),
+         call_time_ms);
+  printf("%16s| bump_malloc %d ms (alloc-only %.1f ms)\n", "Reference ",
+         get_time_ms(&bump_stats), get_allocation_time_ms(&bump_stats) - call_time_ms);
+  stats_t *all_stats[] = {&first_fit_stats, &best_fit_stats, &best_stats};
+  for (int i = 0; i < PERF_COUNTERS; i++) {
+    if (best_stats.perf_counts[i] < 0) {
+      continue;
+    }
+    double per_operation[3];
+    for (int j = 0; j < 3; j++) {
+      per_operation[j] =
+          (double)all_stats[j]->perf_counts[i] / all_stats[j]->operation_count;
+    }
+    printf("%16s| %16.2f => %16.2f => %16.2f\n", perf_counter_names[i],
+           per_operation[0], per_operation[1], per_operation[2]);
+  }
+
+  best_malloc_time_ms[challenge_index] = get_time_ms(&best_stats);
+  best_malloc_utilization_percentage[challenge_index] =
+      get_utilization_percentage(&best_stats);
+}
 
-  best_malloc_time_ms[challenge_index] = best_time_ms;
-  best_malloc_utilization_percentage[challenge_index] = best_utilization_percentage;
+#ifdef ENABLE_BEST_HEAP_PROFILE
+FILE *heap_profile_fp;
+
+void write_heap_profile(const char *data, size_t size) {
+  fwrite(data, 1, size, heap_profile_fp);
+}
+
+// Write the sampled heap profile of the last best_malloc run to |file_name|.
+// It can be read with e.g. `pprof malloc_challenge_with_profile.bin <file>`.
+void dump_heap_profile(const char *file_name) {
+  heap_profile_fp = fopen(file_name, "w");
+  if (!heap_profile_fp) {
+    printf("Cannot open %s\n", file_name);
+    return;
+  }
+  best_dump_heap_profile(write_heap_profile);
+  // pprof needs the memory map to symbolize the stacks.
+  fprintf(heap_profile_fp, "\nMAPPED_LIBRARIES:\n");
+  FILE *maps_fp = fopen("/proc/self/maps", "r");
+  if (maps_fp) {
+    char buffer[4096];
+    size_t size;
+    while ((size = fread(buffer, 1, sizeof(buffer), maps_fp)) > 0) {
+      fwrite(buffer, 1, size, heap_profile_fp);
+    }
+    fclose(maps_fp);
+  }
+  fclose(heap_profile_fp);
 }
+#endif
+
+// A challenge run in a forked child, see run_isolated_challenges().
+typedef struct run_t {
+  char trace_file_name[32];  // Empty if the run is not traced.
+  challenge_t challenge;
+  unsigned seed;
+  initialize_func_t initialize_func;
+  malloc_func_t malloc_func;
+  free_func_t free_func;
+  finalize_func_t finalize_func;
+  // Called in the child before the run, e.g. to configure the allocator.
+  void (*setup_func)(const void *arg);
+  const void *setup_arg;
+  // Where the child writes the heap profile of best_malloc. Empty if none.
+  char heap_profile_file_name[32];
+  stats_t stats;  // The result.
+  pid_t pid;      // The child while it runs.
+  int fd;         // The read end of the pipe from the child.
+  int slot;       // The index of the CPU the child is pinned to.
+} run_t;
 
-// run challenges with differnt algorithm
-void run_challenges_n(int n, size_t min_size, size_t max_size) {
-  stats_t first_fit_stats, best_fit_stats, best_stats;
-  char file[22];
+run_t make_run(const char *trace_file_name, const challenge_t *challenge, unsigned seed,
+               initialize_func_t initialize_func, malloc_func_t malloc_func,
+               free_func_t free_func, finalize_func_t finalize_func) {
+  run_t run;
+  memset(&run, 0, sizeof(run));
+  if (trace_file_name) {
+    snprintf(run.trace_file_name, sizeof(run.trace_file_name), "%s", trace_file_name);
+  }
+  run.challenge = *challenge;
+  run.seed = seed;
+  run.initialize_func = initialize_func;
+  run.malloc_func = malloc_func;
+  run.free_func = free_func;
+  run.finalize_func = finalize_func;
+  return run;
+}
 
-  snprintf(file, 22, "trace%d_first_fit.txt", n);
-  run_challenge(file, min_size, max_size, first_fit_initialize, first_fit_malloc,
-                first_fit_free, first_fit_finalize);
-  first_fit_stats = stats;
+// The allocators that the modes below can pick by name.
+typedef struct allocator_t {
+  const char *name;
+  initialize_func_t initialize_func;
+  malloc_func_t malloc_func;
+  free_func_t free_func;
+  finalize_func_t finalize_func;
+} allocator_t;
 
-  snprintf(file, 21, "trace%d_best_fit.txt", n);
-  run_challenge(file, min_size, max_size, best_fit_initialize, best_fit_malloc,
-                best_fit_free, best_fit_finalize);
-  best_fit_stats = stats;
+#define ALLOCATORS 3
+const allocator_t allocators[ALLOCATORS] = {
+    {"first_fit", first_fit_initialize, first_fit_malloc, first_fit_free, first_fit_finalize},
+    {"best_fit", best_fit_initialize, best_fit_malloc, best_fit_free, best_fit_finalize},
+    {"best", best_initialize, best_malloc, best_free, best_finalize},
+};
 
-  snprintf(file, 18, "trace%d_best.txt", n);
-  run_challenge(file, min_size, max_size, best_initialize, best_malloc, best_free,
-                best_finalize);
-  best_stats = stats;
+// Return the allocator called |name|. Exit if there is none.
+const allocator_t *find_allocator(const char *name) {
+  for (int i = 0; i < ALLOCATORS; i++) {
+    if (strcmp(allocators[i].name, name) == 0) {
+      return &allocators[i];
+    }
+  }
+  fprintf(stderr, "Unknown allocator: %s (first_fit, best_fit or best)\n", name);
+  exit(EXIT_FAILURE);
+}
 
-  print_stats(n, first_fit_stats, best_fit_stats, best_stats);
+run_t make_allocator_run(const challenge_t *challenge, unsigned seed,
+                         const allocator_t *allocator) {
+  return make_run(NULL, challenge, seed, allocator->initialize_func, allocator->malloc_func,
+                  allocator->free_func, allocator->finalize_func);
+}
+
+// The max number of runs at the same time (-j), or 0 for one per core.
+int parallelism = 1;
+
+// Read a CPU list like "0-3,8" from |path| into |cpus|. Return whether it
+// named any CPU.
+bool read_cpu_list(const char *path, cpu_set_t *cpus) {
+  FILE *fp = fopen(path, "r");
+  if (!fp) {
+    return false;
+  }
+  bool found = false;
+  int first, last;
+  while (fscanf(fp, "%d", &first) == 1) {
+    last = first;
+    int c = fgetc(fp);
+    if (c == '-') {
+      if (fscanf(fp, "%d", &last) != 1) {
+        break;
+      }
+      c = fgetc(fp);
+    }
+    for (int cpu = first; cpu <= last && cpu < CPU_SETSIZE; cpu++) {
+      CPU_SET(cpu, cpus);
+      found = true;
+    }
+    if (c != ',') {
+      break;
+    }
+  }
+  fclose(fp);
+  return found;
+}
+
+// Read a number from a sysfs file of |cpu|, or return -1.
+long read_cpu_topology(int cpu, const char *name) {
+  char path[128];
+  snprintf(path, sizeof(path), "/sys/devices/system/cpu/cpu%d/topology/%s", cpu, name);
+  FILE *fp = fopen(path, "r");
+  long value = -1;
+  if (fp) {
+    if (fscanf(fp, "%ld", &value) != 1) {
+      value = -1;
+    }
+    fclose(fp);
+  }
+  return value;
+}
+
+// Store one CPU per physical core to |cpus| and return their number.
+// Hyperthread siblings share the execution units and caches of their core,
+// so runs on two siblings would slow each other down. CPUs isolated from the
+// scheduler (isolcpus) that this process may run on are used if there are
+// any, otherwise all the CPUs it may run on. If the affinity mask cannot be
+// read, a single CPU of -1 is returned, which leaves the runs unpinned.
+int find_run_cpus(int *cpus) {
+  cpu_set_t permitted;
+  CPU_ZERO(&permitted);
+  if (sched_getaffinity(0, sizeof(permitted), &permitted) != 0) {
+    perror("sched_getaffinity");
+    fprintf(stderr, "Runs are not pinned to CPUs.\n");
+    cpus[0] = -1;
+    return 1;
+  }
+  cpu_set_t allowed;
+  CPU_ZERO(&allowed);
+  if (read_cpu_list("/sys/devices/system/cpu/isolated", &allowed)) {
+    CPU_AND(&allowed, &allowed, &permitted);
+    if (!CPU_COUNT(&allowed)) {
+      fprintf(stderr, "No isolated CPU is in the affinity mask of this process, "
+                      "so runs share CPUs with other tasks.\n");
+    }
+  }
+  if (!CPU_COUNT(&allowed)) {
+    allowed = permitted;
+  }
+  long cores[CPU_SETSIZE];
+  int count = 0;
+  for (int cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+    if (!CPU_ISSET(cpu, &allowed)) {
+      continue;
+    }
+    long package = read_cpu_topology(cpu, "physical_package_id");
+    long core_id = read_cpu_topology(cpu, "core_id");
+    // Without the topology, every CPU counts as a core of its own.
+    long core = package < 0 || core_id < 0 ? -1 - cpu : package << 20 | core_id;
+    bool seen = false;
+    for (int i = 0; i < count; i++) {
+      seen |= cores[i] == core;
+    }
+    if (!seen) {
+      cores[count] = core;
+      cpus[count++] = cpu;
+    }
+  }
+  return count;
+}
+
+// Fork a child that runs |run| pinned to |cpu|, or unpinned if |cpu| is -1.
+void start_run(run_t *run, int cpu) {
+  int fds[2];
+  if (pipe(fds) != 0) {
+    perror("pipe");
+    exit(EXIT_FAILURE);
+  }
+  // Unflushed output would otherwise be written by both processes.
+  fflush(stdout);
+  run->pid = fork();
+  if (run->pid < 0) {
+    perror("fork");
+    exit(EXIT_FAILURE);
+  }
+  if (run->pid > 0) {
+    close(fds[1]);
+    run->fd = fds[0];
+    return;
+  }
+
+  close(fds[0]);
+  if (cpu >= 0) {
+    cpu_set_t cpus;
+    CPU_ZERO(&cpus);
+    CPU_SET(cpu, &cpus);
+    if (sched_setaffinity(0, sizeof(cpus), &cpus) != 0) {
+      fprintf(stderr, "Failed to pin a run to CPU %d (%s); it runs unpinned.\n", cpu,
+              strerror(errno));
+    }
+  }
+  srand(run->seed);
+  // Counters count the thread that opened them, so open them again here.
+  perf_counters_open();
+  if (parallelism != 1) {
+    // Runs at the same time would all write the one statistics page.
+    best_attach_stats_page(NULL);
+  }
+  if (run->setup_func) {
+    run->setup_func(run->setup_arg);
+  }
+  challenge_t challenge = run->challenge;
+  if (challenge.cache_mode == WARM_CACHE) {
+    // The run starts on the heap the pass left, so the allocator's memory and
+    // metadata are as warm (mapped, faulted in and cached) as the harness's.
+    challenge_t warm_up = challenge;
+    warm_up.keep_heap = true;
+    run_challenge(NULL, &warm_up, run->initialize_func, run->malloc_func,
+                  run->free_func, run->finalize_func);
+    srand(run->seed);
+    challenge.reuse_heap = true;
+  }
+  run_challenge(run->trace_file_name[0] ? run->trace_file_name : NULL, &challenge,
+                run->initialize_func, run->malloc_func, run->free_func,
+                run->finalize_func);
+#ifdef ENABLE_BEST_HEAP_PROFILE
+  if (run->heap_profile_file_name[0]) {
+    dump_heap_profile(run->heap_profile_file_name);
+  }
+#endif
+  const char *data = (const char *)&stats;
+  size_t written = 0;
+  while (written < sizeof(stats)) {
+    ssize_t size = write(fds[1], data + written, sizeof(stats) - written);
+    if (size <= 0) {
+      _exit(EXIT_FAILURE);
+    }
+    written += size;
+  }
+  fflush(stdout);
+  _exit(EXIT_SUCCESS);
+}
+
+// Collect the stats of |run|, whose child exited with |status|.
+void finish_run(run_t *run, int status) {
+  char *data = (char *)&run->stats;
+  size_t received = 0;
+  while (received < sizeof(run->stats)) {
+    ssize_t size = read(run->fd, data + received, sizeof(run->stats) - received);
+    if (size <= 0) {
+      break;
+    }
+    received += size;
+  }
+  close(run->fd);
+  run->pid = 0;
+  if (received != sizeof(run->stats) || !WIFEXITED(status) ||
+      WEXITSTATUS(status) != EXIT_SUCCESS) {
+    fprintf(stderr, "A challenge run failed (%s %d)\n",
+            WIFSIGNALED(status) ? "signal" : "exit status",
+            WIFSIGNALED(status) ? WTERMSIG(status) : WEXITSTATUS(status));
+    exit(EXIT_FAILURE);
+  }
+}
+
+// Run every challenge of |runs| in a forked child, so that every run starts
+// from the same address space and libc heap: whatever earlier runs mapped
+// stays in their own children. Each child seeds the random numbers with its
+// |seed|, so the workload does not depend on the order of the runs either,
+// and sends its stats back over a pipe.
+//
+// Up to |parallelism| children run at the same time, each pinned to a CPU of
+// a different physical core.
+void run_isolated_challenges(run_t *runs, int count) {
+  int cpus[CPU_SETSIZE];
+  int cpu_count = find_run_cpus(cpus);
+  int slots = parallelism > 0 && parallelism < cpu_count ? parallelism : cpu_count;
+  bool busy[CPU_SETSIZE] = {false};
+  int next = 0;
+  int running = 0;
+  while (next < count || running > 0) {
+    while (running < slots && next < count) {
+      int slot = 0;
+      while (busy[slot]) {
+        slot++;
+      }
+      busy[slot] = true;
+      runs[next].slot = slot;
+      start_run(&runs[next], cpus[slot]);
+      next++;
+      running++;
+    }
+    int status;
+    pid_t pid = waitpid(-1, &status, 0);
+    if (pid < 0) {
+      perror("waitpid");
+      exit(EXIT_FAILURE);
+    }
+    for (int i = 0; i < next; i++) {
+      if (runs[i].pid == pid) {
+        busy[runs[i].slot] = false;
+        finish_run(&runs[i], status);
+        running--;
+        break;
+      }
+    }
+  }
+}
+
+// The allocators of each scored challenge, in the order of their runs.
+enum {
+  NULL_RUN,
+  BUMP_RUN,
+  FIRST_FIT_RUN,
+  BEST_FIT_RUN,
+  BEST_RUN,
+  RUNS_PER_CHALLENGE,
+};
+
+// Store the runs of scored challenge |n| to |runs|.
+void make_challenge_runs(int n, run_t *runs) {
+  char file[32];
+  challenge_t challenge =
+      single_phase_challenge(challenge_sizes[n][0], challenge_sizes[n][1]);
+
+  // Every allocator sees the same objects.
+  unsigned seed = 12 + n;
+
+  // Calibration runs. They are not traced.
+  runs[NULL_RUN] = make_run(NULL, &challenge, seed, null_initialize, null_malloc,
+                            null_free, null_finalize);
+  runs[BUMP_RUN] = make_run(NULL, &challenge, seed, bump_initialize, bump_malloc,
+                            bump_free, bump_finalize);
+
+  snprintf(file, sizeof(file), "trace%d_first_fit.txt", n);
+  runs[FIRST_FIT_RUN] = make_run(file, &challenge, seed, first_fit_initialize,
+                                 first_fit_malloc, first_fit_free, first_fit_finalize);
+
+  snprintf(file, sizeof(file), "trace%d_best_fit.txt", n);
+  runs[BEST_FIT_RUN] = make_run(file, &challenge, seed, best_fit_initialize,
+                                best_fit_malloc, best_fit_free, best_fit_finalize);
+
+  snprintf(file, sizeof(file), "trace%d_best.txt", n);
+  runs[BEST_RUN] = make_run(file, &challenge, seed, best_initialize, best_malloc,
+                            best_free, best_finalize);
+#ifdef ENABLE_BEST_HEAP_PROFILE
+  snprintf(runs[BEST_RUN].heap_profile_file_name,
+           sizeof(runs[BEST_RUN].heap_profile_file_name), "heap_profile%d_best.txt", n);
+#endif
 }
 
 void print_score_data() {
@@ -336,16 +1382,29 @@ void run_challenges() {
       "The result will be different compare to normal builds.\n");
 #endif
 
-  // Warm up run.
-  run_challenge(NULL, 128, 128, first_fit_initialize, first_fit_malloc, first_fit_free,
-                first_fit_finalize);
+  const char *reason = perf_counters_unavailable_reason();
+  if (reason) {
+    printf("Hardware performance counters are unavailable: %s\n", reason);
+  }
+
+  // Warm up run. It uses null_malloc, which unmaps everything it mapped, so
+  // that the children of the scored runs do not inherit any allocator's memory.
+  challenge_t warm_up = single_phase_challenge(128, 128);
+  run_challenge(NULL, &warm_up, null_initialize, null_malloc, null_free, null_finalize);
 
   // Run scored challenges
-  run_challenges_n(1, 128, 128);
-  run_challenges_n(2, 16, 16);
-  run_challenges_n(3, 16, 128);
-  run_challenges_n(4, 256, 4000);
-  run_challenges_n(5, 8, 4000);
+  const int challenge_count = LAST_CHALLENGE_INDEX - FIRST_CHALLENGE_INDEX + 1;
+  run_t runs[challenge_count * RUNS_PER_CHALLENGE];
+  for (int n = FIRST_CHALLENGE_INDEX; n <= LAST_CHALLENGE_INDEX; n++) {
+    make_challenge_runs(n, &runs[(n - FIRST_CHALLENGE_INDEX) * RUNS_PER_CHALLENGE]);
+  }
+  run_isolated_challenges(runs, challenge_count * RUNS_PER_CHALLENGE);
+  for (int n = FIRST_CHALLENGE_INDEX; n <= LAST_CHALLENGE_INDEX; n++) {
+    run_t *challenge_runs = &runs[(n - FIRST_CHALLENGE_INDEX) * RUNS_PER_CHALLENGE];
+    print_stats(n, challenge_runs[NULL_RUN].stats, challenge_runs[BUMP_RUN].stats,
+                challenge_runs[FIRST_FIT_RUN].stats, challenge_runs[BEST_FIT_RUN].stats,
+                challenge_runs[BEST_RUN].stats);
+  }
 
 #ifdef ENABLE_MALLOC_TRACE
   printf(
@@ -358,17 +1417,587 @@ void run_challenges() {
 #endif
 }
 
+// Print the time and utilization of each phase of a multi-phase challenge.
+void print_phase_stats(const challenge_t *challenge, stats_t first_fit_stats,
+                       stats_t best_fit_stats, stats_t best_stats) {
+  stats_t *all_stats[] = {&first_fit_stats, &best_fit_stats, &best_stats};
+  printf("==========================================================================\n");
+  printf("Phase           | %16s => %16s => %16s\n", "first_fit_malloc",
+         "best_fit_malloc", "best_malloc");
+  printf("%-16s+ %16s => %16s => %16s\n", "---------------", "----------------",
+         "----------------", "----------------");
+  for (int phase = 0; phase < challenge->phase_count; phase++) {
+    int time_ms[3];
+    int utilization_percentage[3];
+    for (int i = 0; i < 3; i++) {
+      double begin_time =
+          phase ? all_stats[i]->phase_end_time[phase - 1] : all_stats[i]->begin_time;
+      time_ms[i] = (all_stats[i]->phase_end_time[phase] - begin_time) * 1000;
+      utilization_percentage[i] = (int)(100.0 * all_stats[i]->phase_live_size[phase] /
+                                        all_stats[i]->phase_mapped_size[phase]);
+    }
+    char label[32];
+    snprintf(label, sizeof(label), "%zu-%zu [ms]", challenge->min_size[phase],
+             challenge->max_size[phase]);
+    printf("%16s| %16d => %16d => %16d\n", label, time_ms[0], time_ms[1], time_ms[2]);
+    printf("%16s| %16d => %16d => %16d\n", "Utilization [%] ",
+           utilization_percentage[0], utilization_percentage[1],
+           utilization_percentage[2]);
+  }
+}
+
+// Run a challenge whose size distribution changes between phases. This shows
+// how quickly each allocator adapts to a new workload.
+void run_phase_challenges() {
+  challenge_t challenge = {3, {128, 8, 16}, {128, 4000, 16}, false, 1};
+  run_t runs[3];
+  runs[0] = make_run("trace_phase_first_fit.txt", &challenge, 12, first_fit_initialize,
+                     first_fit_malloc, first_fit_free, first_fit_finalize);
+  runs[1] = make_run("trace_phase_best_fit.txt", &challenge, 12, best_fit_initialize,
+                     best_fit_malloc, best_fit_free, best_fit_finalize);
+  runs[2] = make_run("trace_phase_best.txt", &challenge, 12, best_initialize,
+                     best_malloc, best_free, best_finalize);
+  run_isolated_challenges(runs, 3);
+
+  print_phase_stats(&challenge, runs[0].stats, runs[1].stats, runs[2].stats);
+}
+
+// Run challenges whose objects come from synthetic allocation sites with
+// distinct lifetimes. Build with -DENABLE_BEST_SITE_PREDICTION (make
+// run_sites) to let best_malloc learn the sites.
+void run_site_challenges() {
+  const size_t sizes[][2] = {{128, 128}, {16, 128}, {8, 4000}};
+  const int challenge_count = sizeof(sizes) / sizeof(sizes[0]);
+  run_t runs[challenge_count * 3];
+  for (int i = 0; i < challenge_count; i++) {
+    challenge_t challenge = single_phase_challenge(sizes[i][0], sizes[i][1]);
+    challenge.synthetic_sites = true;
+    challenge.measure_page_spread = true;
+    char file[32];
+    unsigned seed = 12 + i;
+
+    snprintf(file, sizeof(file), "trace_sites%d_first_fit.txt", i + 1);
+    runs[i * 3] = make_run(file, &challenge, seed, first_fit_initialize, first_fit_malloc,
+                           first_fit_free, first_fit_finalize);
+    snprintf(file, sizeof(file), "trace_sites%d_best_fit.txt", i + 1);
+    runs[i * 3 + 1] = make_run(file, &challenge, seed, best_fit_initialize,
+                               best_fit_malloc, best_fit_free, best_fit_finalize);
+    snprintf(file, sizeof(file), "trace_sites%d_best.txt", i + 1);
+    runs[i * 3 + 2] = make_run(file, &challenge, seed, best_initialize, best_malloc,
+                               best_free, best_finalize);
+  }
+  run_isolated_challenges(runs, challenge_count * 3);
+
+  for (int i = 0; i < challenge_count; i++) {
+    char title[16];
+    snprintf(title, sizeof(title), "%zu-%zu", sizes[i][0], sizes[i][1]);
+    print_stats_table(title, runs[i * 3].stats, runs[i * 3 + 1].stats,
+                      runs[i * 3 + 2].stats);
+  }
+}
+
+// A point in the parameter space of best_malloc and its result over all the
+// scored challenges.
+typedef struct sweep_point_t {
+  size_t region_size;
+  size_t split_threshold;
+  size_t slab_chunk_size;
+  size_t slab_max_free;
+  int time_ms;                 // The total time of all challenges.
+  int utilization_percentage;  // The average utilization of all challenges.
+} sweep_point_t;
+
+// Configure best_malloc at the sweep point |arg| in the child of a run.
+void configure_sweep_point(const void *arg) {
+  const sweep_point_t *point = (const sweep_point_t *)arg;
+  best_configure(point->region_size, point->split_threshold, point->slab_chunk_size,
+                 point->slab_max_free, 0, NULL);
+}
+
+// Store the runs of all the scored challenges with best_malloc configured at
+// |point| to |runs|.
+void make_sweep_point_runs(const sweep_point_t *point, run_t *runs) {
+  for (int n = FIRST_CHALLENGE_INDEX; n <= LAST_CHALLENGE_INDEX; n++) {
+    // Every point sees exactly the same objects, the ones of the scored run
+    // of the challenge.
+    challenge_t challenge =
+        single_phase_challenge(challenge_sizes[n][0], challenge_sizes[n][1]);
+    run_t *run = &runs[n - FIRST_CHALLENGE_INDEX];
+    *run = make_run(NULL, &challenge, 12 + n, best_initialize, best_malloc, best_free,
+                    best_finalize);
+    run->setup_func = configure_sweep_point;
+    run->setup_arg = point;
+  }
+}
+
+// Sum up the results of the runs of |point|.
+void collect_sweep_point(sweep_point_t *point, const run_t *runs) {
+  int utilization_sum = 0;
+  point->time_ms = 0;
+  for (int n = FIRST_CHALLENGE_INDEX; n <= LAST_CHALLENGE_INDEX; n++) {
+    const stats_t *stats = &runs[n - FIRST_CHALLENGE_INDEX].stats;
+    point->time_ms += get_time_ms(stats);
+    utilization_sum += get_utilization_percentage(stats);
+  }
+  point->utilization_percentage =
+      utilization_sum / (LAST_CHALLENGE_INDEX - FIRST_CHALLENGE_INDEX + 1);
+}
+
+void print_sweep_point(const sweep_point_t *point) {
+  char slab_max_free[24] = "-";
+  if (point->slab_max_free != (size_t)-1) {
+    snprintf(slab_max_free, sizeof(slab_max_free), "%zu", point->slab_max_free);
+  }
+  printf("%8zu %8zu %8zu %8s | %10d %16d\n", point->region_size,
+         point->split_threshold, point->slab_chunk_size, slab_max_free, point->time_ms,
+         point->utilization_percentage);
+}
+
+int compare_sweep_points_by_time(const void *a, const void *b) {
+  const sweep_point_t *point_a = (const sweep_point_t *)a;
+  const sweep_point_t *point_b = (const sweep_point_t *)b;
+  if (point_a->time_ms != point_b->time_ms) {
+    return point_a->time_ms - point_b->time_ms;
+  }
+  return point_b->utilization_percentage - point_a->utilization_percentage;
+}
+
+// Sweep the tuning knobs of best_malloc and print the Pareto frontier of time
+// against utilization. With |random_points| > 0, that many points are drawn
+// at random from wider ranges instead of walking the grid.
+void run_sweep(int random_points) {
+  const size_t region_sizes[] = {4096, 16384, 65536};
+  const size_t split_thresholds[] = {32, 64, 256};
+  const size_t slab_chunk_sizes[] = {4096, 16384};
+  const size_t slab_max_frees[] = {(size_t)-1, 256, 32};
+  const int grid_points = 3 * 3 * 2 * 3;
+  int point_count = random_points > 0 ? random_points : grid_points;
+  sweep_point_t *points = (sweep_point_t *)malloc(point_count * sizeof(sweep_point_t));
+  // The workload uses rand(), so the random search has its own generator.
+  unsigned seed = 1;
+
+  const int runs_per_point = LAST_CHALLENGE_INDEX - FIRST_CHALLENGE_INDEX + 1;
+  run_t *runs = (run_t *)malloc(point_count * runs_per_point * sizeof(run_t));
+
+  for (int i = 0; i < point_count; i++) {
+    sweep_point_t *point = &points[i];
+    if (random_points > 0) {
+      point->region_size = (size_t)4096 << (rand_r(&seed) % 5);
+      point->split_threshold = 32 + 8 * (rand_r(&seed) % 61);
+      point->slab_chunk_size = (size_t)4096 << (rand_r(&seed) % 4);
+      int depth_log = rand_r(&seed) % 12;
+      point->slab_max_free = depth_log ? (size_t)4 << depth_log : (size_t)-1;
+    } else {
+      point->region_size = region_sizes[i / 18];
+      point->split_threshold = split_thresholds[i / 6 % 3];
+      point->slab_chunk_size = slab_chunk_sizes[i / 3 % 2];
+      point->slab_max_free = slab_max_frees[i % 3];
+    }
+    make_sweep_point_runs(point, &runs[i * runs_per_point]);
+  }
+  run_isolated_challenges(runs, point_count * runs_per_point);
+
+  printf("%8s %8s %8s %8s | %10s %16s\n", "Region", "Split", "Chunk", "Depth",
+         "Time [ms]", "Utilization [%]");
+  for (int i = 0; i < point_count; i++) {
+    collect_sweep_point(&points[i], &runs[i * runs_per_point]);
+    print_sweep_point(&points[i]);
+  }
+  free(runs);
+
+  // A point is on the frontier if no other point is at least as fast and at
+  // least as dense, and strictly better in one of them.
+  qsort(points, point_count, sizeof(sweep_point_t), compare_sweep_points_by_time);
+  printf("\nPareto frontier (time against utilization):\n");
+  printf("%8s %8s %8s %8s | %10s %16s\n", "Region", "Split", "Chunk", "Depth",
+         "Time [ms]", "Utilization [%]");
+  int best_utilization_percentage = -1;
+  for (int i = 0; i < point_count; i++) {
+    if (points[i].utilization_percentage > best_utilization_percentage) {
+      best_utilization_percentage = points[i].utilization_percentage;
+      print_sweep_point(&points[i]);
+    }
+  }
+  free(points);
+}
+
+// Run challenge #5 at geometrically growing scales, up to |max_scale| times
+// the objects, to show how the cost per operation of each allocator grows
+// with the heap. An allocator is dropped from larger scales once a run takes
+// longer than SCALING_TIME_LIMIT_MS, which keeps first_fit from running for
+// hours.
+#define SCALING_TIME_LIMIT_MS 10000
+
+void run_scaling_challenges(int max_scale) {
+  bool active[ALLOCATORS] = {true, true, true};
+  const int n = LAST_CHALLENGE_INDEX;
+
+  printf("Challenge #%d at growing scales, [ns/op] (utilization [%%])\n", n);
+  printf("%8s %10s |", "Scale", "Live [MB]");
+  for (int i = 0; i < ALLOCATORS; i++) {
+    printf(" %11s_malloc |", allocators[i].name);
+  }
+  printf("\n");
+  for (int scale = 1; scale <= max_scale; scale *= 4) {
+    challenge_t challenge =
+        single_phase_challenge(challenge_sizes[n][0], challenge_sizes[n][1]);
+    challenge.scale = scale;
+    run_t runs[ALLOCATORS];
+    int run_count = 0;
+    for (int i = 0; i < ALLOCATORS; i++) {
+      if (active[i]) {
+        runs[run_count++] = make_allocator_run(&challenge, 12 + n, &allocators[i]);
+      }
+    }
+    if (!run_count) {
+      break;
+    }
+    run_isolated_challenges(runs, run_count);
+
+    // Every run allocates the same objects, so any of them gives the live set.
+    printf("%8d %10.1f |", scale,
+           (runs[0].stats.allocated_size - runs[0].stats.freed_size) / 1024.0 / 1024.0);
+    const run_t *run = runs;
+    for (int i = 0; i < ALLOCATORS; i++) {
+      if (!active[i]) {
+        printf(" %18s |", "-");
+        continue;
+      }
+      const stats_t *run_stats = &run->stats;
+      double ns_per_operation =
+          (run_stats->end_time - run_stats->begin_time - run_stats->paused_time) * 1e9 /
+                                run_stats->operation_count;
+      printf(" %10.1f (%3d%%) |", ns_per_operation, get_utilization_percentage(run_stats));
+      active[i] = get_time_ms(run_stats) <= SCALING_TIME_LIMIT_MS;
+      run++;
+    }
+    printf("\n");
+  }
+}
+
+// A soak run logs a sample at the end of the first cycle after every
+// |log_interval| operations, so that every sample sees the same point of
+// the peak-and-trickle pattern of the epochs. The footprint is
+// flagged as growing once the mapped size has grown in SOAK_GROWTH_SAMPLES
+// samples in a row, which a steady live set should never cause.
+#define SOAK_GROWTH_SAMPLES 10
+
+typedef struct soak_t {
+  long long log_interval;
+  long long next_log_count;
+  size_t last_mapped_size;
+  int growth_streak;  // Samples in a row whose mapped size grew.
+  int sample_count;
+  int growing_sample_count;  // Samples flagged as growing.
+  // The statistics of best_malloc, for its free block count. NULL for the
+  // other allocators.
+  best_stats_page_t *page;
+} soak_t;
+
+soak_t soak;
+
+void log_soak_sample() {
+  if (stats.operation_count < (size_t)soak.next_log_count) {
+    return;
+  }
+  soak.next_log_count += soak.log_interval;
+  size_t live_size = stats.allocated_size - stats.freed_size;
+  size_t mapped_size = stats.mmap_size - stats.munmap_size;
+  if (soak.sample_count > 0 && mapped_size > soak.last_mapped_size) {
+    soak.growth_streak++;
+  } else {
+    soak.growth_streak = 0;
+  }
+  soak.last_mapped_size = mapped_size;
+  bool growing = soak.growth_streak >= SOAK_GROWTH_SAMPLES;
+  soak.sample_count++;
+  soak.growing_sample_count += growing;
+
+  double elapsed_time = get_time() - stats.begin_time - stats.paused_time;
+  printf("%12.1f %10.1f %8.1f %10.2f %12.2f %6d%%", stats.operation_count / 1e6, elapsed_time,
+         elapsed_time * 1e9 / stats.operation_count, live_size / 1024.0 / 1024.0,
+         mapped_size / 1024.0 / 1024.0, (int)(100.0 * live_size / mapped_size));
+  if (soak.page) {
+    best_publish_stats();
+    printf(" %12llu", (unsigned long long)soak.page->free_block_count);
+  } else {
+    printf(" %12s", "-");
+  }
+  printf("%s\n", growing ? "  GROWING" : "");
+  fflush(stdout);
+}
+
+// Run challenge #5 with a steady live set for |operations| mallocs and frees
+// (forever if negative) on |allocator_name|, logging utilization, free blocks
+// and mapped bytes every |log_interval| operations. Fragmentation that only
+// builds up over millions of cycles shows up as a footprint that keeps
+// growing.
+void run_soak(const char *allocator_name, long long operations, long long log_interval) {
+  const allocator_t *allocator = find_allocator(allocator_name);
+
+  memset(&soak, 0, sizeof(soak));
+  soak.log_interval = log_interval;
+  soak.next_log_count = log_interval;
+  static best_stats_page_t page;
+  if (allocator->malloc_func == best_malloc) {
+    // A page already published to /dev/shm stays attached.
+    soak.page = stats_page ? stats_page : &page;
+    best_attach_stats_page(soak.page);
+  }
+
+  const int n = LAST_CHALLENGE_INDEX;
+  challenge_t challenge = single_phase_challenge(challenge_sizes[n][0], challenge_sizes[n][1]);
+  challenge.operation_limit = operations > 0 ? operations : -1;
+  challenge.cycle_func = log_soak_sample;
+  printf("Soak: challenge #%d on %s_malloc, a sample every %lld operations\n", n,
+         allocator_name, log_interval);
+  printf("%12s %10s %8s %10s %12s %7s %12s\n", "Ops [M]", "Time [s]", "ns/op", "Live [MB]",
+         "Mapped [MB]", "Util", "Free blocks");
+  srand(12 + n);
+  run_challenge(NULL, &challenge, allocator->initialize_func, allocator->malloc_func,
+                allocator->free_func, allocator->finalize_func);
+  printf("%d of %d samples flagged as growing\n", soak.growing_sample_count,
+         soak.sample_count);
+}
+
+// Find the smallest memory budget at which each allocator still completes
+// each challenge: a binary search over budgets, one run per probe. The search
+// starts from the peak mapped size of a run without a budget and stops when
+// the bounds are within BUDGET_PRECISION_PERCENT of each other or one page.
+// Allocators that find no memory after reclaiming what they can fail with
+// NULL, which ends the run. The budget is shown with the peak live size over
+// it, the share of the budget a perfect allocator would use.
+#define BUDGET_PRECISION_PERCENT 1
+
+typedef struct budget_search_t {
+  const allocator_t *allocator;
+  int challenge;
+  size_t peak_live_size;
+  size_t lower;  // The largest budget that failed, or 0.
+  size_t upper;  // The smallest budget that completed.
+  size_t probe;  // The budget of the next run, 0 for no budget.
+} budget_search_t;
+
+void set_memory_budget(const void *arg) { memory_budget = *(const size_t *)arg; }
+
+bool is_budget_search_done(const budget_search_t *search) {
+  size_t precision = search->upper * BUDGET_PRECISION_PERCENT / 100;
+  return search->upper - search->lower <= (precision > 4096 ? precision : 4096);
+}
+
+void run_budget_search(int allocator_count, const char **allocator_names) {
+  const int challenge_count = LAST_CHALLENGE_INDEX - FIRST_CHALLENGE_INDEX + 1;
+  int search_count = challenge_count * allocator_count;
+  budget_search_t *searches = (budget_search_t *)calloc(search_count, sizeof(budget_search_t));
+  run_t *runs = (run_t *)malloc(search_count * sizeof(run_t));
+  int *run_searches = (int *)malloc(search_count * sizeof(int));
+  for (int i = 0; i < search_count; i++) {
+    searches[i].allocator = find_allocator(allocator_names[i % allocator_count]);
+    searches[i].challenge = FIRST_CHALLENGE_INDEX + i / allocator_count;
+  }
+
+  for (bool first = true;; first = false) {
+    int run_count = 0;
+    for (int i = 0; i < search_count; i++) {
+      if (!first && is_budget_search_done(&searches[i])) {
+        continue;
+      }
+      int n = searches[i].challenge;
+      challenge_t challenge =
+          single_phase_challenge(challenge_sizes[n][0], challenge_sizes[n][1]);
+      runs[run_count] = make_allocator_run(&challenge, 12 + n, searches[i].allocator);
+      runs[run_count].setup_func = set_memory_budget;
+      runs[run_count].setup_arg = &searches[i].probe;
+      run_searches[run_count++] = i;
+    }
+    if (!run_count) {
+      break;
+    }
+    run_isolated_challenges(runs, run_count);
+    for (int i = 0; i < run_count; i++) {
+      budget_search_t *search = &searches[run_searches[i]];
+      const stats_t *run_stats = &runs[i].stats;
+      if (first) {
+        search->upper = run_stats->peak_mapped_size;
+        search->peak_live_size = run_stats->peak_live_size;
+      } else if (run_stats->out_of_memory) {
+        search->lower = search->probe;
+      } else {
+        search->upper = search->probe;
+      }
+      search->probe = (search->lower + search->upper) / 2 / 4096 * 4096;
+    }
+  }
+
+  printf("Minimum memory budget [KB] (peak live / budget [%%])\n");
+  printf("%9s |", "Challenge");
+  for (int i = 0; i < allocator_count; i++) {
+    printf(" %16s_malloc |", searches[i].allocator->name);
+  }
+  printf("\n");
+  for (int i = 0; i < search_count; i++) {
+    const budget_search_t *search = &searches[i];
+    if (i % allocator_count == 0) {
+      printf("%9d |", search->challenge);
+    }
+    printf(" %16zu (%3d%%) |", search->upper / 1024,
+           (int)(100.0 * search->peak_live_size / search->upper));
+    if (i % allocator_count == allocator_count - 1) {
+      printf("\n");
+    }
+  }
+  free(run_searches);
+  free(runs);
+  free(searches);
+}
+
+// Run the challenges with a walk over the live objects after each epoch, and
+// show for each allocator the time per object walked, and the distinct cache
+// lines and pages touched over the ideal: the walked bytes packed with no
+// gaps.
+void run_locality_challenges(int allocator_count, const char **allocator_names) {
+  const int challenge_count = LAST_CHALLENGE_INDEX - FIRST_CHALLENGE_INDEX + 1;
+  int run_count = challenge_count * allocator_count;
+  run_t *runs = (run_t *)malloc(run_count * sizeof(run_t));
+  for (int i = 0; i < run_count; i++) {
+    int n = FIRST_CHALLENGE_INDEX + i / allocator_count;
+    challenge_t challenge = single_phase_challenge(challenge_sizes[n][0], challenge_sizes[n][1]);
+    challenge.locality = true;
+    runs[i] = make_allocator_run(&challenge, 12 + n,
+                                 find_allocator(allocator_names[i % allocator_count]));
+  }
+  run_isolated_challenges(runs, run_count);
+
+  printf("Walk over the live objects: [ns/object] (lines, pages over the ideal)\n");
+  printf("%9s |", "Challenge");
+  for (int i = 0; i < allocator_count; i++) {
+    printf(" %15s_malloc |", allocator_names[i]);
+  }
+  printf("\n");
+  for (int i = 0; i < run_count; i++) {
+    const stats_t *run_stats = &runs[i].stats;
+    if (i % allocator_count == 0) {
+      printf("%9d |", FIRST_CHALLENGE_INDEX + i / allocator_count);
+    }
+    printf(" %6.1f (%4.2f, %5.2f) |", run_stats->walk_time * 1e9 / run_stats->walk_object_count,
+           run_stats->walk_line_count / (run_stats->walk_size / 64.0),
+           run_stats->walk_page_count / (run_stats->walk_size / 4096.0));
+    if (i % allocator_count == allocator_count - 1) {
+      printf("\n");
+    }
+  }
+  free(runs);
+}
+
+// Run the challenges with warm and with cold caches and show the time of
+// each allocator in both. A warm run follows a discarded pass over the same
+// challenge in the same process and reuses its heap, emptied but still
+// mapped; a cold run starts on a new heap right after the caches and TLBs
+// were evicted.
+void run_cache_challenges(int allocator_count, const char **allocator_names) {
+  const int challenge_count = LAST_CHALLENGE_INDEX - FIRST_CHALLENGE_INDEX + 1;
+  int run_count = challenge_count * allocator_count * 2;
+  run_t *runs = (run_t *)malloc(run_count * sizeof(run_t));
+  for (int i = 0; i < run_count; i++) {
+    int n = FIRST_CHALLENGE_INDEX + i / (allocator_count * 2);
+    challenge_t challenge = single_phase_challenge(challenge_sizes[n][0], challenge_sizes[n][1]);
+    challenge.cache_mode = i % 2 ? COLD_CACHE : WARM_CACHE;
+    runs[i] = make_allocator_run(&challenge, 12 + n,
+                                 find_allocator(allocator_names[i / 2 % allocator_count]));
+  }
+  run_isolated_challenges(runs, run_count);
+
+  printf("Time [ms] with warm / cold caches\n");
+  printf("%9s |", "Challenge");
+  for (int i = 0; i < allocator_count; i++) {
+    printf(" %14s_malloc |", allocator_names[i]);
+  }
+  printf("\n");
+  for (int i = 0; i < run_count; i += 2) {
+    if (i % (allocator_count * 2) == 0) {
+      printf("%9d |", FIRST_CHALLENGE_INDEX + i / (allocator_count * 2));
+    }
+    printf(" %9d / %-9d |", get_time_ms(&runs[i].stats), get_time_ms(&runs[i + 1].stats));
+    if (i % (allocator_count * 2) == allocator_count * 2 - 2) {
+      printf("\n");
+    }
+  }
+  free(runs);
+}
+
+void enable_best_reserve(const void *arg) {
+  (void)arg;
+  best_set_reserve(true);
+}
+
+// Time every malloc and show the 99.9th percentile and the slowest, with the
+// number of mallocs that mapped memory from the system and the utilization,
+// after a warm-up cycle.
+// The last column is best_malloc with its real-time reserve, refilled at the
+// end of each epoch, which should have no mallocs that map memory once the
+// reserve has learned the peak demand in the warm-up. The time of its
+// refills, outside malloc, is shown below the table.
+void run_realtime_challenges(int allocator_count, const char **allocator_names) {
+  const int challenge_count = LAST_CHALLENGE_INDEX - FIRST_CHALLENGE_INDEX + 1;
+  const int column_count = allocator_count + 1;
+  int run_count = challenge_count * column_count;
+  run_t *runs = (run_t *)malloc(run_count * sizeof(run_t));
+  for (int i = 0; i < run_count; i++) {
+    int n = FIRST_CHALLENGE_INDEX + i / column_count;
+    int column = i % column_count;
+    challenge_t challenge = single_phase_challenge(challenge_sizes[n][0], challenge_sizes[n][1]);
+    challenge.measure_latency = true;
+    if (column == allocator_count) {
+      challenge.epoch_func = best_refill_reserve;
+      runs[i] = make_allocator_run(&challenge, 12 + n, find_allocator("best"));
+      runs[i].setup_func = enable_best_reserve;
+    } else {
+      runs[i] = make_allocator_run(&challenge, 12 + n, find_allocator(allocator_names[column]));
+    }
+  }
+  run_isolated_challenges(runs, run_count);
+
+  printf("p99.9 / max malloc latency [us] (mallocs that mapped memory, utilization [%%])\n");
+  printf("%9s |", "Challenge");
+  for (int i = 0; i < allocator_count; i++) {
+    printf(" %23s_malloc |", allocator_names[i]);
+  }
+  printf(" %30s |\n", "best_malloc + reserve");
+  for (int i = 0; i < run_count; i++) {
+    const stats_t *run_stats = &runs[i].stats;
+    if (i % column_count == 0) {
+      printf("%9d |", FIRST_CHALLENGE_INDEX + i / column_count);
+    }
+    printf(" %8.1f / %8.1f (%6zu, %2d) |", get_latency_percentile(run_stats, 0.999) * 1e6,
+           run_stats->max_malloc_latency * 1e6, run_stats->mapping_malloc_count,
+           get_utilization_percentage(run_stats));
+    if (i % column_count == column_count - 1) {
+      printf("\n");
+    }
+  }
+  printf("Reserve refills [ms]:");
+  for (int i = column_count - 1; i < run_count; i += column_count) {
+    printf(" %.1f", runs[i].stats.epoch_func_time * 1000);
+  }
+  printf("\n");
+  free(runs);
+}
+
 // Allocate a memory region from the system. |size| needs to be a multiple of
 // 4096 bytes.
 void *mmap_from_system(size_t size) {
   assert(size % 4096 == 0);
+  size_t mapped_size = stats.mmap_size - stats.munmap_size + size;
+  if (memory_budget && mapped_size > memory_budget) {
+    return NULL;
+  }
   stats.mmap_size += size;
+  if (mapped_size > stats.peak_mapped_size) {
+    stats.peak_mapped_size = mapped_size;
+  }
   void *ptr = mmap(NULL, size, PROT_READ | PROT_WRITE,
                    MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
   assert(ptr);
-  if (trace_fp) {
-    fprintf(trace_fp, "m %llu %ld\n", (unsigned long long)ptr, size);
-  }
   return ptr;
 }
 
@@ -379,17 +2008,144 @@ void munmap_to_system(void *ptr, size_t size) {
   assert((uintptr_t)(ptr) % 4096 == 0);
   stats.munmap_size += size;
   int ret = munmap(ptr, size);
-  if (trace_fp) {
-    fprintf(trace_fp, "u %llu %ld\n", (unsigned long long)ptr, size);
-  }
   assert(ret != -1);
 }
 
+char stats_page_path[64];
+
+void remove_stats_page() { unlink(stats_page_path); }
+
+// If BEST_MALLOC_STATS is set, publish the statistics of best_malloc to
+// /dev/shm/best_malloc.<pid> so that `best_malloc_stat.bin <pid>` can watch
+// them while the challenges run.
+void open_stats_page() {
+  if (!getenv("BEST_MALLOC_STATS")) {
+    return;
+  }
+  snprintf(stats_page_path, sizeof(stats_page_path), BEST_STATS_PATH_FORMAT, getpid());
+  int fd = open(stats_page_path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+  if (fd < 0 || ftruncate(fd, sizeof(best_stats_page_t)) != 0) {
+    perror(stats_page_path);
+    exit(EXIT_FAILURE);
+  }
+  stats_page = (best_stats_page_t *)mmap(NULL, sizeof(best_stats_page_t),
+                                         PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  close(fd);
+  assert(stats_page != MAP_FAILED);
+  atexit(remove_stats_page);
+  best_attach_stats_page(stats_page);
+  printf("Publishing best_malloc statistics to %s\n", stats_page_path);
+}
+
+int dump_fd = -1;
+
+void write_dump(const char *data, size_t size) {
+  while (size) {
+    ssize_t written = write(dump_fd, data, size);
+    if (written <= 0) {
+      return;
+    }
+    data += written;
+    size -= written;
+  }
+}
+
+void dump_best_state(int signal_number) {
+  (void)signal_number;
+  int saved_errno = errno;
+  best_request_dump(write_dump);
+  errno = saved_errno;
+}
+
+// If BEST_MALLOC_DUMP is set to a file, append the state of best_malloc to
+// it whenever the process (or a run forked from it) receives SIGUSR1, e.g.
+// `kill -USR1 <pid>` when it grows unexpectedly.
+void install_dump_handler() {
+  const char *path = getenv("BEST_MALLOC_DUMP");
+  if (!path) {
+    return;
+  }
+  dump_fd = open(path, O_WRONLY | O_CREAT | O_APPEND, 0644);
+  if (dump_fd < 0) {
+    perror(path);
+    exit(EXIT_FAILURE);
+  }
+  struct sigaction action;
+  memset(&action, 0, sizeof(action));
+  action.sa_handler = dump_best_state;
+  action.sa_flags = SA_RESTART;
+  sigemptyset(&action.sa_mask);
+  sigaction(SIGUSR1, &action, NULL);
+  printf("Dumping best_malloc state to %s on SIGUSR1 (pid %d)\n", path, getpid());
+}
+
 int main(int argc, char **argv) {
   srand(12);  // Set the rand seed to make the challenges non-deterministic.
   printf("Welcome to the malloc challenge!\n");
   printf("size_of(uint8_t *) = %ld\n", sizeof(uint8_t *));
   printf("size_of(size_t) = %ld\n", sizeof(size_t));
-  run_challenges();
+  perf_counters_open();
+  open_stats_page();
+  install_dump_handler();
+  // -j <runs>: Run up to that many challenges in parallel, one per physical
+  // core. 0 means one per core.
+  if (argc > 2 && strcmp(argv[1], "-j") == 0) {
+    parallelism = atoi(argv[2]);
+    argc -= 2;
+    argv += 2;
+  }
+  if (argc > 1 && strcmp(argv[1], "phase") == 0) {
+    run_phase_challenges();
+  } else if (argc > 1 && strcmp(argv[1], "sites") == 0) {
+    run_site_challenges();
+  } else if (argc > 1 && strcmp(argv[1], "scaling") == 0) {
+    // scaling [max_scale]
+    run_scaling_challenges(argc > 2 ? atoi(argv[2]) : 256);
+  } else if (argc > 1 && strcmp(argv[1], "soak") == 0) {
+    // soak [allocator] [operations, 0 for forever] [log_interval]
+    run_soak(argc > 2 ? argv[2] : "best", argc > 3 ? atoll(argv[3]) : 0,
+             argc > 4 ? atoll(argv[4]) : 10000000);
+  } else if (argc > 1 && strcmp(argv[1], "budget") == 0) {
+    // budget [allocator...]
+    const char *default_allocators[] = {"best_fit", "best"};
+    if (argc > 2) {
+      run_budget_search(argc - 2, (const char **)argv + 2);
+    } else {
+      run_budget_search(2, default_allocators);
+    }
+  } else if (argc > 1 && strcmp(argv[1], "locality") == 0) {
+    // locality [allocator...]
+    const char *default_allocators[] = {"best_fit", "best"};
+    if (argc > 2) {
+      run_locality_challenges(argc - 2, (const char **)argv + 2);
+    } else {
+      run_locality_challenges(2, default_allocators);
+    }
+  } else if (argc > 1 && strcmp(argv[1], "cache") == 0) {
+    // cache [allocator...]
+    const char *default_allocators[] = {"best_fit", "best"};
+    if (argc > 2) {
+      run_cache_challenges(argc - 2, (const char **)argv + 2);
+    } else {
+      run_cache_challenges(2, default_allocators);
+    }
+  } else if (argc > 1 && strcmp(argv[1], "realtime") == 0) {
+    // realtime [allocator...]
+    const char *default_allocators[] = {"best_fit", "best"};
+    if (argc > 2) {
+      run_realtime_challenges(argc - 2, (const char **)argv + 2);
+    } else {
+      run_realtime_challenges(2, default_allocators);
+    }
+  } else if (argc > 1 && strcmp(argv[1], "sweep") == 0) {
+    // sweep [random <points>]
+    int random_points = 0;
+    if (argc > 3 && strcmp(argv[2], "random") == 0) {
+      random_points = atoi(argv[3]);
+    }
+    run_sweep(random_points);
+  } else {
+    run_challenges();
+  }
   return 0;
 }
@@ -0,0 +1,37 @@
+#ifndef MALLOC_HOOKS_H
+#define MALLOC_HOOKS_H
+
+#include <stddef.h>
+
+// Allocator event hooks. Profilers, leak trackers and the trace writer of the
+// harness attach to every allocator through them instead of patching it.
+//
+// Each allocator reports its own events with MALLOC_HOOK(), which costs one
+// well-predicted branch while no hooks are installed:
+//   *  on_malloc: malloc returned |ptr| for a request of |size| bytes.
+//   *  on_free: |ptr| is about to be freed. |size| is the usable size the
+//      allocator knows for it, or 0 if it does not keep one.
+//   *  on_map: the region [ptr, ptr + size) was mapped from the system.
+//   *  on_unmap: the region [ptr, ptr + size) is about to be unmapped.
+typedef struct malloc_hooks_t {
+  void (*on_malloc)(void *ptr, size_t size);
+  void (*on_free)(void *ptr, size_t size);
+  void (*on_map)(void *ptr, size_t size);
+  void (*on_unmap)(void *ptr, size_t size);
+} malloc_hooks_t;
+
+// The installed hooks, or NULL. Use set_malloc_hooks() to change them.
+extern const malloc_hooks_t *malloc_hooks;
+
+// Install |hooks|, or remove them with NULL. Callbacks left NULL are
+// replaced with ones that do nothing, so that a single check suffices.
+void set_malloc_hooks(const malloc_hooks_t *hooks);
+
+#define MALLOC_HOOK(event, ptr, size)                   \
+  do {                                                  \
+    if (__builtin_expect(malloc_hooks != NULL, 0)) {    \
+      malloc_hooks->event((void *)(ptr), (size));       \
+    }                                                   \
+  } while (0)
+
+#endif
@@ -0,0 +1,98 @@
+#include <assert.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/mman.h>
+
+#include "malloc_hooks.h"
+
+// null_malloc is not an allocator to compare against but an instrument to
+// calibrate the harness. It carves objects from a pool that null_initialize()
+// maps and prefaults before the timed region, and recycles them through one
+// free stack per 8-byte size class. A challenge run with it measures the
+// harness loop itself (random numbers, memset, vector_push and the tag check)
+// with allocation reduced to a couple of loads and stores.
+//
+// Objects are packed one after another with an 8-byte header that holds
+// their class, so that the harness touches about as many cache lines and
+// pages as it does with a real allocator. Spreading them out would make the
+// harness, and so the baseline, slower than the allocators it calibrates.
+//
+// The pool does not go through mmap_from_system(), since it is an instrument
+// and not part of any allocator's footprint, which would otherwise count it.
+// If a challenge needs more memory than the pool has, further pools are
+// mapped on demand. For the same reason, only malloc and free are reported to
+// the hooks.
+#define NULL_POOL_SIZE (64 * 1024 * 1024)
+#define NULL_MAX_POOLS 64
+#define NULL_CLASSES (4000 / 8 + 1)
+
+typedef struct null_slot_t {
+  struct null_slot_t *next;
+} null_slot_t;
+
+typedef struct null_heap_t {
+  // |free_heads[size / 8]| is the free stack of objects of |size| bytes.
+  null_slot_t *free_heads[NULL_CLASSES];
+  char *current;
+  char *end;
+  void *pools[NULL_MAX_POOLS];
+  int pool_count;
+} null_heap_t;
+
+null_heap_t null_heap;
+
+// Map a pool, touch every page of it and carve from it from now on.
+void null_add_pool() {
+  assert(null_heap.pool_count < NULL_MAX_POOLS);
+  char *pool = (char *)mmap(NULL, NULL_POOL_SIZE, PROT_READ | PROT_WRITE,
+                            MAP_PRIVATE | MAP_ANONYMOUS | MAP_POPULATE, -1, 0);
+  assert(pool != MAP_FAILED);
+  null_heap.pools[null_heap.pool_count++] = pool;
+  null_heap.current = pool;
+  null_heap.end = pool + NULL_POOL_SIZE;
+}
+
+// This is called at the beginning of each challenge.
+void null_initialize() {
+  for (int i = 0; i < NULL_CLASSES; i++) {
+    null_heap.free_heads[i] = NULL;
+  }
+  null_heap.pool_count = 0;
+  null_add_pool();
+}
+
+// This is called every time an object is allocated. |size| is guaranteed
+// to be a multiple of 8 bytes and meets 8 <= |size| <= 4000.
+void *null_malloc(size_t size) {
+  size_t class = size / 8;
+  null_slot_t *slot = null_heap.free_heads[class];
+  if (slot) {
+    null_heap.free_heads[class] = slot->next;
+  } else {
+    if ((size_t)(null_heap.end - null_heap.current) < sizeof(size_t) + size) {
+      null_add_pool();
+    }
+    *(size_t *)null_heap.current = class;
+    slot = (null_slot_t *)(null_heap.current + sizeof(size_t));
+    null_heap.current += sizeof(size_t) + size;
+  }
+  MALLOC_HOOK(on_malloc, slot, size);
+  return slot;
+}
+
+// This is called every time an object is freed.
+void null_free(void *ptr) {
+  size_t class = ((size_t *)ptr)[-1];
+  MALLOC_HOOK(on_free, ptr, class * 8);
+  null_slot_t *slot = (null_slot_t *)ptr;
+  slot->next = null_heap.free_heads[class];
+  null_heap.free_heads[class] = slot;
+}
+
+// This is called at the end of each challenge.
+void null_finalize() {
+  for (int i = 0; i < null_heap.pool_count; i++) {
+    munmap(null_heap.pools[i], NULL_POOL_SIZE);
+  }
+  null_heap.pool_count = 0;
+}
@@ -0,0 +1,123 @@
+#include <errno.h>
+#include <linux/perf_event.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+// Hardware performance counters around the timed region of a challenge.
+//
+// Each counter is opened on its own rather than as a group, so that a
+// counter the CPU or the kernel does not support only disables itself. If
+// perf_event_open() is not permitted at all (e.g. perf_event_paranoid or a
+// container seccomp profile), every counter reads as -1 and the harness
+// reports them as unavailable.
+#define PERF_COUNTERS 6
+
+const char *perf_counter_names[PERF_COUNTERS] = {
+    "Cycles/op", "Instrs/op", "L1D miss/op", "LLC miss/op", "dTLB miss/op", "Br miss/op",
+};
+
+typedef struct perf_counters_t {
+  int fds[PERF_COUNTERS];
+  // The errno of the first counter that failed to open, or 0.
+  int error;
+} perf_counters_t;
+
+perf_counters_t perf_counters;
+
+// Return the config of a PERF_TYPE_HW_CACHE event that counts read misses.
+uint64_t perf_cache_read_miss(uint64_t cache) {
+  return cache | (PERF_COUNT_HW_CACHE_OP_READ << 8) |
+         (PERF_COUNT_HW_CACHE_RESULT_MISS << 16);
+}
+
+// Open the counters for the calling thread. They stay disabled until
+// perf_counters_start().
+void perf_counters_open() {
+  const uint32_t types[PERF_COUNTERS] = {
+      PERF_TYPE_HARDWARE, PERF_TYPE_HARDWARE, PERF_TYPE_HW_CACHE,
+      PERF_TYPE_HARDWARE, PERF_TYPE_HW_CACHE, PERF_TYPE_HARDWARE,
+  };
+  const uint64_t configs[PERF_COUNTERS] = {
+      PERF_COUNT_HW_CPU_CYCLES,
+      PERF_COUNT_HW_INSTRUCTIONS,
+      perf_cache_read_miss(PERF_COUNT_HW_CACHE_L1D),
+      PERF_COUNT_HW_CACHE_MISSES,
+      perf_cache_read_miss(PERF_COUNT_HW_CACHE_DTLB),
+      PERF_COUNT_HW_BRANCH_MISSES,
+  };
+  perf_counters.error = 0;
+  for (int i = 0; i < PERF_COUNTERS; i++) {
+    struct perf_event_attr attr;
+    memset(&attr, 0, sizeof(attr));
+    attr.size = sizeof(attr);
+    attr.type = types[i];
+    attr.config = configs[i];
+    attr.disabled = 1;
+    attr.exclude_kernel = 1;
+    attr.exclude_hv = 1;
+    perf_counters.fds[i] = syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+    if (perf_counters.fds[i] < 0 && !perf_counters.error) {
+      perf_counters.error = errno;
+    }
+  }
+}
+
+// Return NULL if at least one counter is available, or the reason none is.
+const char *perf_counters_unavailable_reason() {
+  for (int i = 0; i < PERF_COUNTERS; i++) {
+    if (perf_counters.fds[i] >= 0) {
+      return NULL;
+    }
+  }
+  return strerror(perf_counters.error);
+}
+
+void perf_counters_start() {
+  for (int i = 0; i < PERF_COUNTERS; i++) {
+    if (perf_counters.fds[i] >= 0) {
+      ioctl(perf_counters.fds[i], PERF_EVENT_IOC_RESET, 0);
+      ioctl(perf_counters.fds[i], PERF_EVENT_IOC_ENABLE, 0);
+    }
+  }
+}
+
+// Stop counting without resetting, e.g. around measurements that are not part
+// of the run.
+void perf_counters_pause() {
+  for (int i = 0; i < PERF_COUNTERS; i++) {
+    if (perf_counters.fds[i] >= 0) {
+      ioctl(perf_counters.fds[i], PERF_EVENT_IOC_DISABLE, 0);
+    }
+  }
+}
+
+void perf_counters_resume() {
+  for (int i = 0; i < PERF_COUNTERS; i++) {
+    if (perf_counters.fds[i] >= 0) {
+      ioctl(perf_counters.fds[i], PERF_EVENT_IOC_ENABLE, 0);
+    }
+  }
+}
+
+// Stop the counters and store their values to |counts|, or -1 for the
+// counters that are not available.
+void perf_counters_stop(long long *counts) {
+  for (int i = 0; i < PERF_COUNTERS; i++) {
+    if (perf_counters.fds[i] >= 0) {
+      ioctl(perf_counters.fds[i], PERF_EVENT_IOC_DISABLE, 0);
+    }
+  }
+  for (int i = 0; i < PERF_COUNTERS; i++) {
+    uint64_t count;
+    if (perf_counters.fds[i] < 0 ||
+        read(perf_counters.fds[i], &count, sizeof(count)) != sizeof(count)) {
+      counts[i] = -1;
+    } else {
+      counts[i] = (long long)count;
+    }
+  }
+}
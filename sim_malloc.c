@@ -0,0 +1,673 @@
+#include <assert.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+// sim_malloc replays malloc traces against a simulation of first_fit_malloc
+// or best_fit_malloc that never touches the memory it manages.
+//
+//   ./sim_malloc.bin [-p first_fit|best_fit] [-r region_size] [-H header_size]
+//                    [-e] [-c caches] trace...
+//
+// The allocator's algorithm runs on out-of-band blocks over a virtual address
+// space: regions are handed out by a counter instead of mmap, and the
+// metadata that the real allocator keeps in front of each object lives in an
+// array. Placement decisions are the same as in the real allocator, including
+// the shape of the best-fit tree, so the utilization and page numbers are the
+// ones the real allocator would reach on the same trace, without writing a
+// byte of the heap. That makes it cheap to try placement parameters (-r, -H)
+// on traces far larger than the memory of the machine.
+//
+// Only the 'a' and 'f' events are replayed, so the trace of any allocator
+// replays the same program. best_malloc, though, is not simulated: its
+// learned slab classes and second tree have no model here, so its traces
+// (trace<N>_best.txt) are rejected rather than passed off as its numbers.
+// At every 'e' (end of epoch) event the page spread is
+// taken as in the harness: the distinct 4 KiB pages that hold live objects
+// over live bytes / 4096. -e prints a line per epoch.
+//
+// With -c, every address the allocator and the program touch goes through a
+// model of set-associative L1, L2 and last-level caches and a TLB, all with
+// LRU replacement: the headers read and written by the allocator (every node
+// of a list or tree walk), the object bytes written by the harness after a
+// malloc and the first and last bytes it checks before a free. Misses are
+// counted per malloc or free, for the allocator and the objects separately,
+// so that the accesses of an index can be compared deterministically, which
+// hardware counters cannot do. The allocator's accesses are those of the
+// simulated policy only, the free list of first_fit or the tree of best_fit,
+// and say nothing about best_malloc's slabs and trees. |caches| is "default" (32 KiB 8-way L1, 1 MiB
+// 16-way L2, 32 MiB 16-way LLC, 64-entry 4-way TLB) or a list of overrides
+// like "l1=48K:12,llc=8M:16,tlb=1536:12", with sizes in bytes for the caches
+// and in entries for the TLB.
+
+#define PAGE_SIZE 4096
+// The simulated address space starts here, so that no block is at 0.
+#define BASE_ADDRESS 0x100000000ULL
+// |left| and |right| of a block that links to nothing.
+#define NO_BLOCK 0
+// The first block is the dummy free slot of the real allocators. It lives in
+// their static heap, simulated by the page below the address space.
+#define DUMMY_BLOCK 1
+#define CACHE_LINE_SIZE 64
+
+typedef enum cache_level_t {
+  L1_CACHE,
+  L2_CACHE,
+  LAST_LEVEL_CACHE,
+  TLB,
+  CACHE_LEVELS,
+} cache_level_t;
+
+const char *cache_level_names[CACHE_LEVELS] = {"L1", "L2", "LLC", "TLB"};
+
+// Who touches an address.
+typedef enum access_kind_t {
+  ALLOCATOR_ACCESS,
+  OBJECT_ACCESS,
+  ACCESS_KINDS,
+} access_kind_t;
+
+typedef struct cache_config_t {
+  size_t entries;  // Cache lines or TLB entries.
+  size_t ways;
+} cache_config_t;
+
+typedef enum policy_t {
+  FIRST_FIT,
+  BEST_FIT,
+} policy_t;
+
+const char *policy_names[] = {"first_fit", "best_fit"};
+
+typedef struct params_t {
+  policy_t policy;
+  size_t region_size;
+  size_t header_size;  // Also the split threshold, as in the real allocators.
+  bool per_epoch;
+  bool model_caches;
+  cache_config_t caches[CACHE_LEVELS];
+} params_t;
+
+// A set-associative cache or TLB with LRU replacement. |keys| holds the line
+// or page number + 1 of each way, or 0 if the way is empty.
+typedef struct cache_t {
+  size_t sets;
+  size_t ways;
+  uint64_t *keys;
+  uint64_t *stamps;
+  uint64_t clock;
+  size_t misses[ACCESS_KINDS];
+} cache_t;
+
+// A slot with its header. Free slots are linked through |left| in the free
+// list of first_fit, and through |left| and |right| in the AVL tree of
+// best_fit.
+typedef struct block_t {
+  uint64_t address;  // The address of the header.
+  size_t size;       // Without the header.
+  uint32_t left;
+  uint32_t right;
+  int height;
+} block_t;
+
+// An open-addressing table from the pointers recorded in a trace to the
+// simulated block and the requested size. Freed entries stay as tombstones
+// until the table is rebuilt.
+typedef struct object_map_t {
+  unsigned long long *keys;  // 0 if empty, ~key if freed.
+  uint32_t *blocks;
+  size_t *sizes;
+  size_t mask;
+  size_t used;  // Live entries and tombstones.
+} object_map_t;
+
+typedef struct sim_t {
+  params_t params;
+  block_t *blocks;
+  size_t block_count;
+  size_t block_capacity;
+  uint32_t free_head;  // The head of the free list or the root of the tree.
+  uint64_t next_address;
+  // The live object bytes on each page of the address space, and the number
+  // of pages that have any.
+  uint32_t *page_live_bytes;
+  size_t page_capacity;
+  size_t live_page_count;
+  size_t mapped_size;
+  size_t peak_mapped_size;
+  size_t live_size;
+  double spread_sum;
+  double peak_spread;
+  size_t epoch_count;
+  cache_t caches[CACHE_LEVELS];
+} sim_t;
+
+void cache_init(cache_t *cache, const cache_config_t *config) {
+  cache->ways = config->ways;
+  cache->sets = config->entries / config->ways;
+  cache->keys = (uint64_t *)calloc(cache->sets * cache->ways, sizeof(uint64_t));
+  cache->stamps = (uint64_t *)calloc(cache->sets * cache->ways, sizeof(uint64_t));
+  cache->clock = 0;
+  memset(cache->misses, 0, sizeof(cache->misses));
+}
+
+// Look |key| up and return whether it hit. A miss replaces the least
+// recently used way of the set.
+bool cache_access(cache_t *cache, uint64_t key, access_kind_t kind) {
+  size_t base = key % cache->sets * cache->ways;
+  size_t victim = base;
+  cache->clock++;
+  for (size_t i = base; i < base + cache->ways; i++) {
+    if (cache->keys[i] == key + 1) {
+      cache->stamps[i] = cache->clock;
+      return true;
+    }
+    if (cache->stamps[i] < cache->stamps[victim]) {
+      victim = i;
+    }
+  }
+  cache->keys[victim] = key + 1;
+  cache->stamps[victim] = cache->clock;
+  cache->misses[kind]++;
+  return false;
+}
+
+// Feed the bytes [address, address + size) through the caches and the TLB.
+// A line goes to the next level only if it missed the one before.
+void touch(sim_t *sim, uint64_t address, size_t size, access_kind_t kind) {
+  if (!sim->params.model_caches) {
+    return;
+  }
+  for (uint64_t line = address / CACHE_LINE_SIZE;
+       line <= (address + size - 1) / CACHE_LINE_SIZE; line++) {
+    for (int level = L1_CACHE; level <= LAST_LEVEL_CACHE; level++) {
+      if (cache_access(&sim->caches[level], line, kind)) {
+        break;
+      }
+    }
+  }
+  for (uint64_t page = address / PAGE_SIZE; page <= (address + size - 1) / PAGE_SIZE;
+       page++) {
+    cache_access(&sim->caches[TLB], page, kind);
+  }
+}
+
+// The allocator reads or writes the header of |block|.
+void touch_block(sim_t *sim, uint32_t block) {
+  if (block != NO_BLOCK) {
+    touch(sim, sim->blocks[block].address, sim->params.header_size, ALLOCATOR_ACCESS);
+  }
+}
+
+// Return a new block. The block array may move, so indices are used instead
+// of pointers.
+uint32_t new_block(sim_t *sim, uint64_t address, size_t size) {
+  if (sim->block_count == sim->block_capacity) {
+    sim->block_capacity = sim->block_capacity * 2 + 1024;
+    sim->blocks = (block_t *)realloc(sim->blocks, sim->block_capacity * sizeof(block_t));
+  }
+  block_t *block = &sim->blocks[sim->block_count];
+  block->address = address;
+  block->size = size;
+  block->left = NO_BLOCK;
+  block->right = NO_BLOCK;
+  block->height = 1;
+  return sim->block_count++;
+}
+
+// The AVL tree of best_fit_malloc, on block indices.
+uint32_t balance_tree(sim_t *sim, uint32_t tree) {
+  block_t *b = sim->blocks;
+  touch_block(sim, b[tree].left);
+  touch_block(sim, b[tree].right);
+  int left_height = b[tree].left ? b[b[tree].left].height : 0;
+  int right_height = b[tree].right ? b[b[tree].right].height : 0;
+  b[tree].height = 1 + (left_height > right_height ? left_height : right_height);
+
+  if (left_height + 1 < right_height) {
+    uint32_t right = b[tree].right;
+    b[tree].right = b[right].left;
+    b[right].left = tree;
+    return right;
+  } else if (right_height + 1 < left_height) {
+    uint32_t left = b[tree].left;
+    b[tree].left = b[left].right;
+    b[left].right = tree;
+    return left;
+  }
+  return tree;
+}
+
+uint32_t insert_recursive(sim_t *sim, uint32_t block, uint32_t tree) {
+  touch_block(sim, tree);
+  if (!tree) {
+    return block;
+  } else if (sim->blocks[block].size < sim->blocks[tree].size) {
+    sim->blocks[tree].left = insert_recursive(sim, block, sim->blocks[tree].left);
+  } else {
+    sim->blocks[tree].right = insert_recursive(sim, block, sim->blocks[tree].right);
+  }
+  return balance_tree(sim, tree);
+}
+
+uint32_t remove_recursive(sim_t *sim, uint32_t block, uint32_t tree) {
+  block_t *b = sim->blocks;
+  touch_block(sim, tree);
+  if (block == tree) {
+    if (!b[tree].left) {
+      return b[tree].right;
+    }
+    if (!b[tree].right) {
+      return b[tree].left;
+    }
+    uint32_t root = b[tree].right;
+    while (b[root].left) {
+      root = b[root].left;
+      touch_block(sim, root);
+    }
+    b[root].right = remove_recursive(sim, root, b[tree].right);
+    b[root].left = b[tree].left;
+    return root;
+  }
+  if (b[tree].size < b[block].size) {
+    b[tree].right = remove_recursive(sim, block, b[tree].right);
+  } else {
+    b[tree].left = remove_recursive(sim, block, b[tree].left);
+  }
+  return balance_tree(sim, tree);
+}
+
+// Add a free block to the free list (at its head) or the tree.
+void add_free_block(sim_t *sim, uint32_t block) {
+  touch_block(sim, block);
+  if (sim->params.policy == FIRST_FIT) {
+    sim->blocks[block].left = sim->free_head;
+    sim->free_head = block;
+  } else {
+    sim->blocks[block].left = NO_BLOCK;
+    sim->blocks[block].right = NO_BLOCK;
+    sim->blocks[block].height = 1;
+    sim->free_head = insert_recursive(sim, block, sim->free_head);
+  }
+}
+
+// Return the free block the policy picks for |size|, or NO_BLOCK, and take
+// it out of the free list or the tree.
+uint32_t take_free_block(sim_t *sim, size_t size) {
+  block_t *b = sim->blocks;
+  if (sim->params.policy == FIRST_FIT) {
+    uint32_t block = sim->free_head;
+    uint32_t prev = NO_BLOCK;
+    while (block && b[block].size < size) {
+      touch_block(sim, block);
+      prev = block;
+      block = b[block].left;
+    }
+    if (block) {
+      if (prev) {
+        b[prev].left = b[block].left;
+      } else {
+        sim->free_head = b[block].left;
+      }
+      b[block].left = NO_BLOCK;
+    }
+    return block;
+  }
+  uint32_t block = sim->free_head;
+  uint32_t best = NO_BLOCK;
+  while (block) {
+    touch_block(sim, block);
+    if (b[block].size < size) {
+      block = b[block].right;
+    } else {
+      best = block;
+      block = b[block].left;
+    }
+  }
+  if (best) {
+    sim->free_head = remove_recursive(sim, best, sim->free_head);
+  }
+  return best;
+}
+
+// Add (|sign| > 0) or remove the live bytes of [address, address + size) to
+// or from their pages.
+void update_pages(sim_t *sim, uint64_t address, size_t size, int sign) {
+  uint64_t first = (address - BASE_ADDRESS) / PAGE_SIZE;
+  uint64_t last = (address + size - 1 - BASE_ADDRESS) / PAGE_SIZE;
+  for (uint64_t page = first; page <= last; page++) {
+    uint64_t begin = page == first ? address : BASE_ADDRESS + page * PAGE_SIZE;
+    uint64_t end = page == last ? address + size : BASE_ADDRESS + (page + 1) * PAGE_SIZE;
+    uint32_t bytes = end - begin;
+    if (sign > 0) {
+      sim->live_page_count += sim->page_live_bytes[page] == 0;
+      sim->page_live_bytes[page] += bytes;
+    } else {
+      sim->page_live_bytes[page] -= bytes;
+      sim->live_page_count -= sim->page_live_bytes[page] == 0;
+    }
+  }
+}
+
+// Map a region from the simulated address space and add it as a free block.
+void map_region(sim_t *sim, size_t size) {
+  size_t region_size = sim->params.region_size;
+  if (region_size < sim->params.header_size + size) {
+    region_size = (sim->params.header_size + size + PAGE_SIZE - 1) / PAGE_SIZE * PAGE_SIZE;
+  }
+  uint64_t address = sim->next_address;
+  sim->next_address += region_size;
+  size_t page_count = (sim->next_address - BASE_ADDRESS) / PAGE_SIZE;
+  if (page_count > sim->page_capacity) {
+    size_t capacity = sim->page_capacity * 2 + 1024;
+    if (capacity < page_count) {
+      capacity = page_count;
+    }
+    sim->page_live_bytes =
+        (uint32_t *)realloc(sim->page_live_bytes, capacity * sizeof(uint32_t));
+    memset(sim->page_live_bytes + sim->page_capacity, 0,
+           (capacity - sim->page_capacity) * sizeof(uint32_t));
+    sim->page_capacity = capacity;
+  }
+  sim->mapped_size += region_size;
+  if (sim->mapped_size > sim->peak_mapped_size) {
+    sim->peak_mapped_size = sim->mapped_size;
+  }
+  add_free_block(sim, new_block(sim, address, region_size - sim->params.header_size));
+}
+
+uint32_t sim_malloc(sim_t *sim, size_t size) {
+  uint32_t block = take_free_block(sim, size);
+  if (!block) {
+    map_region(sim, size);
+    block = take_free_block(sim, size);
+    assert(block);
+  }
+  touch_block(sim, block);
+  size_t remaining_size = sim->blocks[block].size - size;
+  if (remaining_size > sim->params.header_size) {
+    sim->blocks[block].size = size;
+    uint64_t address = sim->blocks[block].address + sim->params.header_size + size;
+    add_free_block(sim, new_block(sim, address, remaining_size - sim->params.header_size));
+  }
+  return block;
+}
+
+void sim_free(sim_t *sim, uint32_t block) { add_free_block(sim, block); }
+
+// Return the slot of |key| in |map|: the entry of |key|, or the empty slot
+// where it would go.
+size_t object_map_slot(const object_map_t *map, unsigned long long key) {
+  size_t slot = (size_t)((key >> 3) * 0x9e3779b97f4a7c15ULL) & map->mask;
+  while (map->keys[slot] && map->keys[slot] != key) {
+    slot = (slot + 1) & map->mask;
+  }
+  return slot;
+}
+
+// Rebuild |map| without its tombstones, with room for at least |count|
+// entries.
+void object_map_rebuild(object_map_t *map, size_t count) {
+  object_map_t old = *map;
+  size_t capacity = 1024;
+  while (capacity < count * 4) {
+    capacity *= 2;
+  }
+  map->keys = (unsigned long long *)calloc(capacity, sizeof(unsigned long long));
+  map->blocks = (uint32_t *)malloc(capacity * sizeof(uint32_t));
+  map->sizes = (size_t *)malloc(capacity * sizeof(size_t));
+  map->mask = capacity - 1;
+  map->used = 0;
+  for (size_t i = 0; old.keys && i <= old.mask; i++) {
+    // A tombstone has its top bit set, since pointers do not.
+    if (old.keys[i] && !(old.keys[i] >> 63)) {
+      size_t slot = object_map_slot(map, old.keys[i]);
+      map->keys[slot] = old.keys[i];
+      map->blocks[slot] = old.blocks[i];
+      map->sizes[slot] = old.sizes[i];
+      map->used++;
+    }
+  }
+  free(old.keys);
+  free(old.blocks);
+  free(old.sizes);
+}
+
+void record_epoch(sim_t *sim, unsigned long long epoch) {
+  if (!sim->live_size) {
+    return;
+  }
+  double spread = sim->live_page_count / ((double)sim->live_size / PAGE_SIZE);
+  sim->spread_sum += spread;
+  sim->epoch_count++;
+  if (spread > sim->peak_spread) {
+    sim->peak_spread = spread;
+  }
+  if (sim->params.per_epoch) {
+    printf("  epoch %6llu: live %10zu, mapped %10zu, utilization %3d%%, %8zu pages, "
+           "spread %.2f\n",
+           epoch, sim->live_size, sim->mapped_size,
+           (int)(100.0 * sim->live_size / sim->mapped_size), sim->live_page_count, spread);
+  }
+}
+
+// Replay |file_name| event by event, so that traces larger than the memory
+// of the machine work as long as their live set fits.
+void replay_trace(const char *file_name, const params_t *params) {
+  FILE *fp = fopen(file_name, "r");
+  if (!fp) {
+    fprintf(stderr, "Failed to open a trace file: %s\n", file_name);
+    exit(EXIT_FAILURE);
+  }
+  sim_t sim;
+  memset(&sim, 0, sizeof(sim));
+  sim.params = *params;
+  sim.next_address = BASE_ADDRESS;
+  new_block(&sim, 0, 0);  // NO_BLOCK
+  sim.free_head = new_block(&sim, BASE_ADDRESS - PAGE_SIZE, 0);
+  assert(sim.free_head == DUMMY_BLOCK);
+  if (params->model_caches) {
+    for (int level = 0; level < CACHE_LEVELS; level++) {
+      cache_init(&sim.caches[level], &params->caches[level]);
+    }
+  }
+  size_t free_count = 0;
+  object_map_t map;
+  memset(&map, 0, sizeof(map));
+  object_map_rebuild(&map, 0);
+  size_t live_count = 0;
+  size_t malloc_count = 0;
+
+  char line[128];
+  while (fgets(line, sizeof(line), fp)) {
+    char type;
+    unsigned long long ptr;
+    size_t size = 0;
+    int fields = sscanf(line, "%c %llu %zu", &type, &ptr, &size);
+    if (type == 'e' && fields >= 2) {
+      record_epoch(&sim, ptr);
+      continue;
+    }
+    if (fields != 3 || (type != 'a' && type != 'f')) {
+      continue;
+    }
+    if (type == 'a') {
+      if ((map.used + 1) * 2 > map.mask + 1) {
+        object_map_rebuild(&map, live_count + 1);
+      }
+      size_t slot = object_map_slot(&map, ptr);
+      uint32_t block = sim_malloc(&sim, size);
+      map.used += !map.keys[slot];
+      map.keys[slot] = ptr;
+      map.blocks[slot] = block;
+      map.sizes[slot] = size;
+      uint64_t address = sim.blocks[block].address + params->header_size;
+      // The harness fills the object with its tag.
+      touch(&sim, address, size, OBJECT_ACCESS);
+      update_pages(&sim, address, size, 1);
+      sim.live_size += size;
+      live_count++;
+      malloc_count++;
+    } else {
+      size_t slot = object_map_slot(&map, ptr);
+      if (!map.keys[slot]) {
+        continue;
+      }
+      uint32_t block = map.blocks[slot];
+      uint64_t address = sim.blocks[block].address + params->header_size;
+      // The harness checks the first and the last byte of the tag.
+      touch(&sim, address, 1, OBJECT_ACCESS);
+      touch(&sim, address + map.sizes[slot] - 1, 1, OBJECT_ACCESS);
+      update_pages(&sim, address, map.sizes[slot], -1);
+      free_count++;
+      sim.live_size -= map.sizes[slot];
+      sim_free(&sim, block);
+      map.keys[slot] = ~ptr;
+      live_count--;
+    }
+  }
+  fclose(fp);
+
+  printf("%s (simulated %s): %zu mallocs, utilization %d%%, mapped %zu bytes (peak %zu), "
+         "%zu pages with live objects, page spread %.2f (max %.2f)\n",
+         file_name, policy_names[params->policy], malloc_count,
+         sim.mapped_size ? (int)(100.0 * sim.live_size / sim.mapped_size) : 0,
+         sim.mapped_size, sim.peak_mapped_size, sim.live_page_count,
+         sim.epoch_count ? sim.spread_sum / sim.epoch_count : 0, sim.peak_spread);
+  if (params->model_caches) {
+    size_t operation_count = malloc_count + free_count;
+    printf("  Misses per malloc or free with the %s index (allocator + objects):",
+           policy_names[params->policy]);
+    for (int level = 0; level < CACHE_LEVELS; level++) {
+      const cache_t *cache = &sim.caches[level];
+      printf(" %s %.2f (%.2f + %.2f)%s", cache_level_names[level],
+             (double)(cache->misses[ALLOCATOR_ACCESS] + cache->misses[OBJECT_ACCESS]) /
+                 operation_count,
+             (double)cache->misses[ALLOCATOR_ACCESS] / operation_count,
+             (double)cache->misses[OBJECT_ACCESS] / operation_count,
+             level + 1 < CACHE_LEVELS ? "," : "\n");
+      free(cache->keys);
+      free(cache->stamps);
+    }
+  }
+  free(map.keys);
+  free(map.blocks);
+  free(map.sizes);
+  free(sim.blocks);
+  free(sim.page_live_bytes);
+}
+
+// Return whether |file_name| is a trace of best_malloc, by the names the
+// trace build gives them.
+bool is_best_malloc_trace(const char *file_name) {
+  const char *suffix = "_best.txt";
+  size_t length = strlen(file_name);
+  return length >= strlen(suffix) && strcmp(file_name + length - strlen(suffix), suffix) == 0;
+}
+
+// Parse overrides like "l1=48K:12,tlb=1536:12" into |configs|. Return false
+// if they are malformed.
+bool parse_cache_configs(const char *text, cache_config_t *configs) {
+  const char *keys[CACHE_LEVELS] = {"l1", "l2", "llc", "tlb"};
+  while (*text) {
+    int level = 0;
+    size_t length = 0;
+    while (level < CACHE_LEVELS) {
+      length = strlen(keys[level]);
+      if (strncmp(text, keys[level], length) == 0 && text[length] == '=') {
+        break;
+      }
+      level++;
+    }
+    if (level == CACHE_LEVELS) {
+      return false;
+    }
+    char *end;
+    size_t size = strtoul(text + length + 1, &end, 0);
+    if (*end == 'K') {
+      size *= 1024;
+      end++;
+    } else if (*end == 'M') {
+      size *= 1024 * 1024;
+      end++;
+    }
+    if (*end != ':') {
+      return false;
+    }
+    size_t ways = strtoul(end + 1, &end, 0);
+    size_t entries = level == TLB ? size : size / CACHE_LINE_SIZE;
+    if (!ways || entries < ways || entries % ways || (*end && *end != ',')) {
+      return false;
+    }
+    configs[level].entries = entries;
+    configs[level].ways = ways;
+    text = *end ? end + 1 : end;
+  }
+  return true;
+}
+
+int main(int argc, char **argv) {
+  params_t params = {BEST_FIT, PAGE_SIZE, 0, false, false,
+                     {{32768 / CACHE_LINE_SIZE, 8},
+                      {1048576 / CACHE_LINE_SIZE, 16},
+                      {33554432 / CACHE_LINE_SIZE, 16},
+                      {64, 4}}};
+  int first_trace = 1;
+  while (first_trace < argc && argv[first_trace][0] == '-') {
+    const char *option = argv[first_trace];
+    if (strcmp(option, "-e") == 0) {
+      params.per_epoch = true;
+      first_trace++;
+      continue;
+    }
+    if (first_trace + 1 >= argc) {
+      break;
+    }
+    const char *value = argv[first_trace + 1];
+    if (strcmp(option, "-p") == 0 && strcmp(value, "first_fit") == 0) {
+      params.policy = FIRST_FIT;
+    } else if (strcmp(option, "-p") == 0 && strcmp(value, "best_fit") == 0) {
+      params.policy = BEST_FIT;
+    } else if (strcmp(option, "-r") == 0) {
+      params.region_size = strtoul(value, NULL, 0);
+    } else if (strcmp(option, "-H") == 0) {
+      params.header_size = strtoul(value, NULL, 0);
+    } else if (strcmp(option, "-c") == 0) {
+      params.model_caches = true;
+      if (strcmp(value, "default") != 0 && !parse_cache_configs(value, params.caches)) {
+        fprintf(stderr, "Invalid cache configuration: %s\n", value);
+        return EXIT_FAILURE;
+      }
+    } else {
+      break;
+    }
+    first_trace += 2;
+  }
+  if (first_trace >= argc || params.region_size % PAGE_SIZE != 0 || !params.region_size) {
+    fprintf(stderr,
+            "Usage: %s [-p first_fit|best_fit] [-r region_size] [-H header_size] [-e] "
+            "[-c caches] trace...\n",
+            argv[0]);
+    return EXIT_FAILURE;
+  }
+  // The headers of the real allocators: first_fit_metadata_t and
+  // best_fit_metadata_t.
+  if (!params.header_size) {
+    params.header_size = params.policy == FIRST_FIT ? 16 : 32;
+  }
+  for (int i = first_trace; i < argc; i++) {
+    if (is_best_malloc_trace(argv[i])) {
+      fprintf(stderr,
+              "%s is a trace of best_malloc, which sim_malloc does not simulate. "
+              "Use the traces of first_fit or best_fit.\n",
+              argv[i]);
+      return EXIT_FAILURE;
+    }
+  }
+  for (int i = first_trace; i < argc; i++) {
+    replay_trace(argv[i], &params);
+  }
+  return 0;
+}
@@ -0,0 +1,174 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <time.h>
+#include <unistd.h>
+
+// A single-producer, single-consumer ring of trace events, drained to a file,
+// a named pipe or a Unix socket by a background thread.
+//
+// The thread under test only stores an event to the next slot and publishes
+// it by advancing |head|; the formatting and the write() calls happen on the
+// drain thread. When the ring is full, the event is dropped instead of
+// blocking the producer, and counted. Events are written in the text format
+// of the trace files, so a reader of a pipe or a socket sees the same lines.
+#define TRACE_RING_CAPACITY (1 << 16)  // Events. A power of two.
+#define TRACE_DRAIN_BUFFER_SIZE 65536
+#define TRACE_DRAIN_IDLE_NS 50000
+
+typedef struct trace_event_t {
+  uint64_t ptr;  // The epoch for an "e" event.
+  uint64_t size;
+  char kind;
+} trace_event_t;
+
+typedef struct trace_ring_t {
+  trace_event_t events[TRACE_RING_CAPACITY];
+  // Written by the producer and the drain thread respectively, on separate
+  // cache lines so that they do not bounce between the cores.
+  _Alignas(64) atomic_size_t head;
+  size_t dropped_count;  // Owned by the producer.
+  _Alignas(64) atomic_size_t tail;
+  size_t write_failed_count;  // Owned by the drain thread.
+  _Alignas(64) atomic_bool stopping;
+  int fd;
+  pthread_t thread;
+} trace_ring_t;
+
+trace_ring_t trace_ring;
+
+// Append an event. Called only from the thread under test.
+void trace_ring_push(char kind, uint64_t ptr, uint64_t size) {
+  size_t head = atomic_load_explicit(&trace_ring.head, memory_order_relaxed);
+  size_t tail = atomic_load_explicit(&trace_ring.tail, memory_order_acquire);
+  if (head - tail == TRACE_RING_CAPACITY) {
+    trace_ring.dropped_count++;
+    return;
+  }
+  trace_event_t *event = &trace_ring.events[head & (TRACE_RING_CAPACITY - 1)];
+  event->ptr = ptr;
+  event->size = size;
+  event->kind = kind;
+  atomic_store_explicit(&trace_ring.head, head + 1, memory_order_release);
+}
+
+// Write all of |data|, or return false once the reader has gone away.
+bool trace_ring_write(const char *data, size_t size) {
+  while (size) {
+    ssize_t written = write(trace_ring.fd, data, size);
+    if (written < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      return false;
+    }
+    data += written;
+    size -= written;
+  }
+  return true;
+}
+
+void *trace_ring_drain(void *arg) {
+  (void)arg;
+  // A reader that closes a pipe or a socket should end the trace, not the
+  // process. SIGPIPE goes to the writing thread, so blocking it here makes
+  // write() fail with EPIPE instead.
+  sigset_t signals;
+  sigemptyset(&signals);
+  sigaddset(&signals, SIGPIPE);
+  pthread_sigmask(SIG_BLOCK, &signals, NULL);
+  static char buffer[TRACE_DRAIN_BUFFER_SIZE];
+  bool connected = true;
+  while (true) {
+    // Read |stopping| first, so that no event published before it was set is
+    // missed by the final pass.
+    bool stopping = atomic_load_explicit(&trace_ring.stopping, memory_order_acquire);
+    size_t head = atomic_load_explicit(&trace_ring.head, memory_order_acquire);
+    size_t tail = atomic_load_explicit(&trace_ring.tail, memory_order_relaxed);
+    if (head == tail) {
+      if (stopping) {
+        break;
+      }
+      struct timespec idle = {0, TRACE_DRAIN_IDLE_NS};
+      nanosleep(&idle, NULL);
+      continue;
+    }
+    size_t used = 0;
+    for (; tail != head; tail++) {
+      const trace_event_t *event = &trace_ring.events[tail & (TRACE_RING_CAPACITY - 1)];
+      if (!connected) {
+        trace_ring.write_failed_count++;
+        continue;
+      }
+      if (TRACE_DRAIN_BUFFER_SIZE - used < 64) {
+        connected = trace_ring_write(buffer, used);
+        used = 0;
+      }
+      if (event->kind == 'e') {
+        used += snprintf(buffer + used, TRACE_DRAIN_BUFFER_SIZE - used, "e %d\n",
+                         (int)event->ptr);
+      } else {
+        used += snprintf(buffer + used, TRACE_DRAIN_BUFFER_SIZE - used, "%c %llu %ld\n",
+                         event->kind, (unsigned long long)event->ptr, (long)event->size);
+      }
+    }
+    if (connected && used) {
+      connected = trace_ring_write(buffer, used);
+    }
+    atomic_store_explicit(&trace_ring.tail, tail, memory_order_release);
+  }
+  return NULL;
+}
+
+// Open |target| and start draining to it. |target| is "unix:<path>" to
+// connect to a listening Unix stream socket, or the path of a file or a
+// named pipe. Return false if it cannot be opened.
+bool trace_ring_open(const char *target) {
+  const char *socket_prefix = "unix:";
+  if (strncmp(target, socket_prefix, strlen(socket_prefix)) == 0) {
+    struct sockaddr_un address;
+    memset(&address, 0, sizeof(address));
+    address.sun_family = AF_UNIX;
+    snprintf(address.sun_path, sizeof(address.sun_path), "%s",
+             target + strlen(socket_prefix));
+    trace_ring.fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (trace_ring.fd >= 0 &&
+        connect(trace_ring.fd, (struct sockaddr *)&address, sizeof(address)) != 0) {
+      close(trace_ring.fd);
+      trace_ring.fd = -1;
+    }
+  } else {
+    trace_ring.fd = open(target, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  }
+  if (trace_ring.fd < 0) {
+    return false;
+  }
+  atomic_store(&trace_ring.head, 0);
+  atomic_store(&trace_ring.tail, 0);
+  atomic_store(&trace_ring.stopping, false);
+  trace_ring.dropped_count = 0;
+  trace_ring.write_failed_count = 0;
+  if (pthread_create(&trace_ring.thread, NULL, trace_ring_drain, NULL) != 0) {
+    close(trace_ring.fd);
+    return false;
+  }
+  return true;
+}
+
+// Drain the remaining events, stop the thread and close the target. Return
+// the number of events that were lost, because the ring was full or the
+// reader went away.
+size_t trace_ring_close() {
+  atomic_store_explicit(&trace_ring.stopping, true, memory_order_release);
+  pthread_join(trace_ring.thread, NULL);
+  close(trace_ring.fd);
+  return trace_ring.dropped_count + trace_ring.write_failed_count;
+}
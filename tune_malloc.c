@@ -0,0 +1,342 @@
+#include <assert.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+
+#include "best_malloc.h"
+
+// tune_malloc synthesizes a best_malloc configuration from malloc traces.
+//
+//   ./tune_malloc.bin [-o best_malloc_config.h] [-s max_slowdown] [-n note] trace...
+//
+// Every trace is replayed against the real best_malloc for each candidate
+// configuration on a grid of static size classes, region sizes, slab chunk
+// sizes and quick-list depths. Speed is measured by the number of mallocs
+// that miss the slab fast path, which unlike wall-clock time is deterministic.
+// The candidate with the smallest total peak footprint whose slow-path count
+// is within |max_slowdown| times that of the default configuration (ties go to
+// fewer slow paths) is written out as a header that best_malloc includes when
+// built with -DUSE_BEST_MALLOC_CONFIG. |note|, e.g. where the traces came
+// from, is added to the comment at the top of the header.
+
+#define MAX_CLASSES 4
+#define MAX_SIZE 4000
+
+typedef struct event_t {
+  char type;  // 'a' or 'f'
+  unsigned long long ptr;
+  size_t size;
+} event_t;
+
+typedef struct trace_t {
+  const char *file_name;
+  event_t *events;
+  size_t event_count;
+  size_t malloc_count;
+} trace_t;
+
+typedef struct config_t {
+  size_t region_size;
+  size_t slab_chunk_size;
+  size_t slab_max_free;
+  int static_class_count;
+  size_t static_class_sizes[MAX_CLASSES];
+} config_t;
+
+typedef struct result_t {
+  size_t footprint;   // The sum of the peak footprints of all traces.
+  size_t slow_paths;  // The sum of the slow-path mallocs of all traces.
+} result_t;
+
+// The memory mapped by best_malloc during one replay. Everything is unmapped
+// when the replay finishes, since best_malloc never returns memory itself.
+typedef struct region_t {
+  void *ptr;
+  size_t size;
+} region_t;
+
+region_t *regions;
+size_t region_count;
+size_t region_capacity;
+size_t mapped_size;
+size_t peak_mapped_size;
+
+void *mmap_from_system(size_t size) {
+  assert(size % 4096 == 0);
+  void *ptr = mmap(NULL, size, PROT_READ | PROT_WRITE,
+                   MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  assert(ptr != MAP_FAILED);
+  if (region_count == region_capacity) {
+    region_capacity = region_capacity * 2 + 128;
+    regions = (region_t *)realloc(regions, region_capacity * sizeof(region_t));
+  }
+  regions[region_count].ptr = ptr;
+  regions[region_count].size = size;
+  region_count++;
+  mapped_size += size;
+  if (mapped_size > peak_mapped_size) {
+    peak_mapped_size = mapped_size;
+  }
+  return ptr;
+}
+
+void munmap_to_system(void *ptr, size_t size) {
+  // Regions are unmapped all at once at the end of the replay.
+  mapped_size -= size;
+}
+
+void release_regions() {
+  for (size_t i = 0; i < region_count; i++) {
+    munmap(regions[i].ptr, regions[i].size);
+  }
+  region_count = 0;
+  mapped_size = 0;
+}
+
+// Read the 'a' and 'f' events of a trace. Other events are skipped.
+void read_trace(const char *file_name, trace_t *trace) {
+  FILE *fp = fopen(file_name, "r");
+  if (!fp) {
+    fprintf(stderr, "Failed to open a trace file: %s\n", file_name);
+    exit(EXIT_FAILURE);
+  }
+  size_t capacity = 0;
+  trace->file_name = file_name;
+  trace->events = NULL;
+  trace->event_count = 0;
+  trace->malloc_count = 0;
+  char line[128];
+  while (fgets(line, sizeof(line), fp)) {
+    event_t event;
+    if (sscanf(line, "%c %llu %zu", &event.type, &event.ptr, &event.size) != 3 ||
+        (event.type != 'a' && event.type != 'f')) {
+      continue;
+    }
+    if (event.type == 'a' && (event.size == 0 || event.size > MAX_SIZE)) {
+      fprintf(stderr, "%s: unsupported object size %zu\n", file_name, event.size);
+      exit(EXIT_FAILURE);
+    }
+    if (trace->event_count == capacity) {
+      capacity = capacity * 2 + 1024;
+      trace->events = (event_t *)realloc(trace->events, capacity * sizeof(event_t));
+    }
+    trace->events[trace->event_count++] = event;
+    trace->malloc_count += event.type == 'a';
+  }
+  fclose(fp);
+}
+
+// An open-addressing table from the pointers recorded in a trace to the
+// pointers best_malloc returned during the replay.
+typedef struct pointer_map_t {
+  unsigned long long *keys;
+  void **values;
+  size_t mask;
+} pointer_map_t;
+
+size_t pointer_map_slot(pointer_map_t *map, unsigned long long key) {
+  size_t slot = (size_t)((key >> 3) * 0x9e3779b97f4a7c15ULL) & map->mask;
+  while (map->keys[slot] && map->keys[slot] != key) {
+    slot = (slot + 1) & map->mask;
+  }
+  return slot;
+}
+
+// Replay one trace and add its peak footprint and slow-path count to
+// |result|.
+void replay_trace(const trace_t *trace, pointer_map_t *map, result_t *result) {
+  memset(map->keys, 0, (map->mask + 1) * sizeof(map->keys[0]));
+  peak_mapped_size = 0;
+  best_initialize();
+  for (size_t i = 0; i < trace->event_count; i++) {
+    const event_t *event = &trace->events[i];
+    size_t slot = pointer_map_slot(map, event->ptr);
+    if (event->type == 'a') {
+      map->keys[slot] = event->ptr;
+      map->values[slot] = best_malloc(event->size);
+    } else if (map->keys[slot]) {
+      best_free(map->values[slot]);
+      // Deleting from a linear-probing table would break the probe chains, so
+      // the entry stays as a tombstone pointing to nothing.
+      map->values[slot] = NULL;
+      map->keys[slot] = ~event->ptr;
+    }
+  }
+  result->slow_paths += best_slow_path_count();
+  best_finalize();
+  release_regions();
+  result->footprint += peak_mapped_size;
+}
+
+// Replay all traces with |config|.
+result_t evaluate(const config_t *config, const trace_t *traces, int trace_count,
+                  pointer_map_t *map) {
+  // The split threshold stays at its default, the size of the metadata.
+  best_configure(config->region_size, BEST_SPLIT_THRESHOLD, config->slab_chunk_size,
+                 config->slab_max_free, config->static_class_count,
+                 config->static_class_sizes);
+  result_t result = {0, 0};
+  for (int i = 0; i < trace_count; i++) {
+    replay_trace(&traces[i], map, &result);
+  }
+  return result;
+}
+
+void write_config(FILE *fp, const config_t *config, result_t result,
+                  result_t default_result, char **file_names, int trace_count,
+                  const char *note) {
+  fprintf(fp, "// Generated by tune_malloc.bin. Do not edit.\n//\n// Traces:\n");
+  for (int i = 0; i < trace_count; i++) {
+    fprintf(fp, "//   %s\n", file_names[i]);
+  }
+  if (note) {
+    fprintf(fp, "// %s\n", note);
+  }
+  fprintf(fp, "//\n// Simulated peak footprint: %zu bytes (default: %zu bytes)\n",
+          result.footprint, default_result.footprint);
+  fprintf(fp, "// Slow-path mallocs: %zu (default: %zu)\n\n", result.slow_paths,
+          default_result.slow_paths);
+  fprintf(fp, "#define BEST_REGION_SIZE %zu\n", config->region_size);
+  fprintf(fp, "#define BEST_SLAB_CHUNK_SIZE %zu\n", config->slab_chunk_size);
+  if (config->slab_max_free == (size_t)-1) {
+    fprintf(fp, "#define BEST_SLAB_MAX_FREE ((size_t)-1)\n");
+  } else {
+    fprintf(fp, "#define BEST_SLAB_MAX_FREE %zu\n", config->slab_max_free);
+  }
+  fprintf(fp, "#define BEST_STATIC_CLASS_COUNT %d\n", config->static_class_count);
+  fprintf(fp, "#define BEST_STATIC_CLASS_SIZES {");
+  for (int i = 0; i < config->static_class_count; i++) {
+    fprintf(fp, "%s%zu", i ? ", " : "", config->static_class_sizes[i]);
+  }
+  fprintf(fp, "%s}\n", config->static_class_count ? "" : "0");
+}
+
+int main(int argc, char **argv) {
+  const char *output_file_name = NULL;
+  double max_slowdown = 1.0;
+  const char *note = NULL;
+  int first_trace = 1;
+  while (first_trace + 1 < argc && argv[first_trace][0] == '-') {
+    if (strcmp(argv[first_trace], "-o") == 0) {
+      output_file_name = argv[first_trace + 1];
+    } else if (strcmp(argv[first_trace], "-s") == 0) {
+      max_slowdown = atof(argv[first_trace + 1]);
+    } else if (strcmp(argv[first_trace], "-n") == 0) {
+      note = argv[first_trace + 1];
+    } else {
+      break;
+    }
+    first_trace += 2;
+  }
+  int trace_count = argc - first_trace;
+  if (trace_count <= 0) {
+    fprintf(stderr,
+            "Usage: %s [-o best_malloc_config.h] [-s max_slowdown] [-n note] trace...\n",
+            argv[0]);
+    return EXIT_FAILURE;
+  }
+
+  trace_t *traces = (trace_t *)malloc(trace_count * sizeof(trace_t));
+  size_t max_malloc_count = 0;
+  size_t malloc_count = 0;
+  size_t histogram[MAX_SIZE / 8 + 1] = {0};
+  for (int i = 0; i < trace_count; i++) {
+    read_trace(argv[first_trace + i], &traces[i]);
+    if (traces[i].malloc_count > max_malloc_count) {
+      max_malloc_count = traces[i].malloc_count;
+    }
+    for (size_t j = 0; j < traces[i].event_count; j++) {
+      if (traces[i].events[j].type == 'a') {
+        histogram[traces[i].events[j].size / 8]++;
+        malloc_count++;
+      }
+    }
+  }
+  if (!malloc_count) {
+    fprintf(stderr, "The traces contain no allocations\n");
+    return EXIT_FAILURE;
+  }
+
+  pointer_map_t map;
+  size_t map_capacity = 1024;
+  while (map_capacity < max_malloc_count * 2) {
+    map_capacity *= 2;
+  }
+  map.keys = (unsigned long long *)malloc(map_capacity * sizeof(unsigned long long));
+  map.values = (void **)malloc(map_capacity * sizeof(void *));
+  map.mask = map_capacity - 1;
+
+  // Candidate size classes are the hottest sizes that make up at least 1% of
+  // the allocations, hottest first.
+  size_t hot_sizes[MAX_CLASSES];
+  int hot_count = 0;
+  for (int k = 0; k < MAX_CLASSES; k++) {
+    size_t best = 0;
+    for (size_t i = 1; i <= MAX_SIZE / 8; i++) {
+      bool taken = false;
+      for (int j = 0; j < hot_count; j++) {
+        taken |= hot_sizes[j] == i * 8;
+      }
+      if (!taken && histogram[i] > histogram[best]) {
+        best = i;
+      }
+    }
+    if (!best || histogram[best] * 100 < malloc_count) {
+      break;
+    }
+    hot_sizes[hot_count++] = best * 8;
+  }
+
+  config_t default_config = {4096, 4096, (size_t)-1, 0, {0}};
+  result_t default_result = evaluate(&default_config, traces, trace_count, &map);
+  // The default of each parameter comes first, so that ties keep it.
+  const size_t region_sizes[] = {4096, 8192, 16384, 65536};
+  const size_t slab_chunk_sizes[] = {4096, 8192, 16384};
+  const size_t slab_max_frees[] = {(size_t)-1, 256, 64, 16};
+  config_t best_config = default_config;
+  result_t best_result = default_result;
+  for (int classes = 0; classes <= hot_count; classes++) {
+    for (size_t r = 0; r < sizeof(region_sizes) / sizeof(region_sizes[0]); r++) {
+      for (size_t c = 0; c < sizeof(slab_chunk_sizes) / sizeof(slab_chunk_sizes[0]);
+           c++) {
+        for (size_t q = 0; q < sizeof(slab_max_frees) / sizeof(slab_max_frees[0]);
+             q++) {
+          config_t config = {region_sizes[r], slab_chunk_sizes[c], slab_max_frees[q],
+                             classes, {0}};
+          memcpy(config.static_class_sizes, hot_sizes, classes * sizeof(size_t));
+          result_t result = evaluate(&config, traces, trace_count, &map);
+          if (result.slow_paths > default_result.slow_paths * max_slowdown) {
+            continue;
+          }
+          if (result.footprint < best_result.footprint ||
+              (result.footprint == best_result.footprint &&
+               result.slow_paths < best_result.slow_paths)) {
+            best_config = config;
+            best_result = result;
+          }
+        }
+      }
+    }
+  }
+
+  FILE *fp = stdout;
+  if (output_file_name) {
+    fp = fopen(output_file_name, "w");
+    if (!fp) {
+      fprintf(stderr, "Failed to open %s\n", output_file_name);
+      return EXIT_FAILURE;
+    }
+  }
+  write_config(fp, &best_config, best_result, default_result, argv + first_trace,
+               trace_count, note);
+  if (output_file_name) {
+    fclose(fp);
+    printf("Wrote %s: footprint %zu => %zu bytes, slow paths %zu => %zu\n",
+           output_file_name, default_result.footprint, best_result.footprint,
+           default_result.slow_paths, best_result.slow_paths);
+  }
+  return 0;
+}